@@ -0,0 +1,427 @@
+// bench.cpp – Benchmark PiVision over a models × test cases matrix.
+//
+// Test cases follow the testing/ layout: prompts/<cat>/<name>.txt paired with
+// images/<cat>/<name>.{jpg,jpeg,png}. Each model is loaded once; every case
+// gets `warmup` discarded runs and `repeat` measured runs. Per-case statistics
+// are written as JSON and CSV.
+#include "pivision.h"
+#include "config.h"
+
+#include <getopt.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+struct ModelSpec {
+    std::string name;
+    std::string model_path;
+    std::string vision_path;
+};
+
+struct BenchCase {
+    std::string name;    // e.g. PCat3_A
+    std::string prompt;
+    std::string image_path;
+};
+
+// min / median / p95 / stddev of one metric over the measured runs
+struct Stats {
+    double min = 0.0, median = 0.0, p95 = 0.0, mean = 0.0, stddev = 0.0;
+};
+
+struct CaseResult {
+    std::string model;
+    std::string name;
+    int runs = 0;
+    int failed = 0;
+    Stats ttft_ms, prompt_tps, gen_tps, wall_ms, sample_ms_per_token;
+};
+
+static const char *METRICS[] = {"ttft_ms", "prompt_tps", "gen_tps", "wall_ms", "sample_ms_per_token"};
+
+static void usage(const char *prog) {
+    std::cerr
+        << "Usage: " << prog << " --model <name|llm.gguf[,proj.gguf]> [--model ...] [options]\n"
+        << "\nOptions:\n"
+        << "  --model <m>            Model directory name under --models-dir, or an explicit\n"
+        << "                         llm.gguf[,mmproj.gguf] pair (repeatable)\n"
+        << "  --models-dir <dir>     Model root laid out as <name>/model/*.gguf and <name>/mmproj/*.gguf\n"
+        << "                         (default: llama.cpp/models)\n"
+        << "  --prompts <dir>        Prompt root (default: testing/prompts)\n"
+        << "  --images <dir>         Image root (default: testing/images)\n"
+        << "  --case <filter>        Only cases whose name starts with <filter> (repeatable)\n"
+        << "  --warmup <n>           Discarded runs per case (default: 1)\n"
+        << "  --repeat <n>           Measured runs per case (default: 5)\n"
+        << "  --n-ctx <n>            Context size (default: 4096, or the config's)\n"
+        << "  --config <file>        Apply the tuning settings (performance, sampler, ...) of a\n"
+        << "                         config file to every model; its model and case keys are ignored\n"
+        << "  --warm-caches          Keep the prompt-prefix and image embedding caches on\n"
+        << "                         (by default every run does the full work)\n"
+        << "  --out <prefix>         Write <prefix>.json and <prefix>.csv (default: pivision_bench)\n"
+        << "  --verbose              Print every run\n";
+}
+
+static std::string json_escape(const std::string &s) {
+    std::string out;
+    out.reserve(s.size());
+    for (char c : s) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n";  break;
+            case '\t': out += "\\t";  break;
+            default:   out += c;
+        }
+    }
+    return out;
+}
+
+// First regular file in dir, in name order; empty if none
+static std::string first_file(const fs::path &dir) {
+    std::vector<std::string> files;
+    std::error_code ec;
+    for (const auto &e : fs::directory_iterator(dir, ec))
+        if (e.is_regular_file()) files.push_back(e.path().string());
+    std::sort(files.begin(), files.end());
+    return files.empty() ? std::string() : files.front();
+}
+
+static bool resolve_model(const std::string &spec, const std::string &models_dir, ModelSpec &out) {
+    size_t comma = spec.find(',');
+    if (spec.find(".gguf") != std::string::npos) {
+        out.model_path = spec.substr(0, comma);
+        out.vision_path = comma == std::string::npos ? std::string() : spec.substr(comma + 1);
+        out.name = fs::path(out.model_path).stem().string();
+    } else {
+        out.name = spec;
+        out.model_path = first_file(fs::path(models_dir) / spec / "model");
+        out.vision_path = first_file(fs::path(models_dir) / spec / "mmproj");
+    }
+    if (out.model_path.empty() || !fs::exists(out.model_path)) {
+        std::cerr << "error: model not found: " << spec << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Pairs every prompt with the image of the same basename, as config_script.sh does
+static std::vector<BenchCase> find_cases(const std::string &prompts_dir, const std::string &images_dir,
+                                         const std::vector<std::string> &filters) {
+    std::vector<BenchCase> cases;
+    std::error_code ec;
+    for (const auto &cat : fs::directory_iterator(prompts_dir, ec)) {
+        if (!cat.is_directory()) continue;
+        for (const auto &p : fs::directory_iterator(cat.path(), ec)) {
+            if (p.path().extension() != ".txt") continue;
+            const std::string base = p.path().stem().string();
+
+            bool wanted = filters.empty();
+            for (const auto &f : filters)
+                wanted = wanted || base.rfind(f, 0) == 0;
+            if (!wanted) continue;
+
+            fs::path image;
+            for (const char *ext : {".jpg", ".jpeg", ".png"}) {
+                fs::path candidate = fs::path(images_dir) / cat.path().filename() / (base + ext);
+                if (fs::exists(candidate)) {
+                    image = candidate;
+                    break;
+                }
+            }
+            if (image.empty()) {
+                std::cerr << "skipping " << base << ": no matching image\n";
+                continue;
+            }
+
+            std::ifstream pf(p.path());
+            BenchCase c;
+            c.name = base;
+            c.prompt.assign(std::istreambuf_iterator<char>(pf), std::istreambuf_iterator<char>());
+            c.image_path = image.string();
+            cases.push_back(std::move(c));
+        }
+    }
+    std::sort(cases.begin(), cases.end(), [](const BenchCase &a, const BenchCase &b) { return a.name < b.name; });
+    return cases;
+}
+
+static Stats compute_stats(std::vector<double> v) {
+    Stats s;
+    if (v.empty()) return s;
+    std::sort(v.begin(), v.end());
+    const size_t n = v.size();
+    s.min = v.front();
+    s.median = n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2.0;
+    // Nearest-rank percentile
+    s.p95 = v[static_cast<size_t>(std::ceil(0.95 * n)) - 1];
+    for (double x : v) s.mean += x;
+    s.mean /= n;
+    if (n > 1) {
+        double ss = 0.0;
+        for (double x : v) ss += (x - s.mean) * (x - s.mean);
+        s.stddev = std::sqrt(ss / (n - 1));
+    }
+    return s;
+}
+
+static const Stats &metric(const CaseResult &r, int i) {
+    switch (i) {
+        case 0:  return r.ttft_ms;
+        case 1:  return r.prompt_tps;
+        case 2:  return r.gen_tps;
+        case 3:  return r.wall_ms;
+        default: return r.sample_ms_per_token;
+    }
+}
+
+static bool write_json(const std::string &path, const std::vector<CaseResult> &results,
+                       const std::vector<std::pair<std::string, double>> &loads, int warmup, int repeat) {
+    std::ofstream f(path);
+    if (!f) return false;
+
+    char buf[64];
+    f << "{\n  \"warmup\": " << warmup << ",\n  \"repeat\": " << repeat << ",\n";
+    f << "  \"models\": [\n";
+    for (size_t i = 0; i < loads.size(); ++i) {
+        snprintf(buf, sizeof(buf), "%.1f", loads[i].second);
+        f << "    {\"model\": \"" << json_escape(loads[i].first) << "\", \"load_ms\": " << buf << "}"
+          << (i + 1 < loads.size() ? ",\n" : "\n");
+    }
+    f << "  ],\n  \"cases\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const CaseResult &r = results[i];
+        f << "    {\n"
+          << "      \"model\": \"" << json_escape(r.model) << "\",\n"
+          << "      \"case\": \"" << json_escape(r.name) << "\",\n"
+          << "      \"runs\": " << r.runs << ",\n"
+          << "      \"failed\": " << r.failed;
+        for (int m = 0; m < 5; ++m) {
+            const Stats &s = metric(r, m);
+            snprintf(buf, sizeof(buf), "%.2f", s.min);
+            f << ",\n      \"" << METRICS[m] << "\": {\"min\": " << buf;
+            snprintf(buf, sizeof(buf), "%.2f", s.median);
+            f << ", \"median\": " << buf;
+            snprintf(buf, sizeof(buf), "%.2f", s.p95);
+            f << ", \"p95\": " << buf;
+            snprintf(buf, sizeof(buf), "%.2f", s.mean);
+            f << ", \"mean\": " << buf;
+            snprintf(buf, sizeof(buf), "%.2f", s.stddev);
+            f << ", \"stddev\": " << buf << "}";
+        }
+        f << "\n    }" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    f << "  ]\n}\n";
+    return static_cast<bool>(f);
+}
+
+static bool write_csv(const std::string &path, const std::vector<CaseResult> &results) {
+    std::ofstream f(path);
+    if (!f) return false;
+
+    f << "model,case,runs,failed";
+    for (const char *m : METRICS)
+        for (const char *s : {"min", "median", "p95", "mean", "stddev"})
+            f << "," << m << "_" << s;
+    f << "\n";
+
+    char buf[64];
+    for (const auto &r : results) {
+        f << r.model << "," << r.name << "," << r.runs << "," << r.failed;
+        for (int m = 0; m < 5; ++m) {
+            const Stats &s = metric(r, m);
+            for (double v : {s.min, s.median, s.p95, s.mean, s.stddev}) {
+                snprintf(buf, sizeof(buf), "%.2f", v);
+                f << "," << buf;
+            }
+        }
+        f << "\n";
+    }
+    return static_cast<bool>(f);
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string> model_specs, filters;
+    std::string models_dir = "llama.cpp/models";
+    std::string prompts_dir = "testing/prompts";
+    std::string images_dir = "testing/images";
+    std::string out_prefix = "pivision_bench";
+    std::string config_path;
+    int warmup = 1, repeat = 5, n_ctx = 0;
+    bool warm_caches = false, verbose = false;
+
+    static struct option long_opts[] = {
+        {"model", required_argument, nullptr, 'm'},
+        {"models-dir", required_argument, nullptr, 'M'},
+        {"prompts", required_argument, nullptr, 'p'},
+        {"images", required_argument, nullptr, 'i'},
+        {"case", required_argument, nullptr, 'c'},
+        {"warmup", required_argument, nullptr, 'w'},
+        {"repeat", required_argument, nullptr, 'r'},
+        {"n-ctx", required_argument, nullptr, 'n'},
+        {"config", required_argument, nullptr, 'C'},
+        {"warm-caches", no_argument, nullptr, 'W'},
+        {"out", required_argument, nullptr, 'o'},
+        {"verbose", no_argument, nullptr, 'V'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:M:p:i:c:w:r:n:C:Wo:Vh", long_opts, nullptr)) != -1) {
+        switch (opt) {
+            case 'm': model_specs.emplace_back(optarg); break;
+            case 'M': models_dir = optarg; break;
+            case 'p': prompts_dir = optarg; break;
+            case 'i': images_dir = optarg; break;
+            case 'c': filters.emplace_back(optarg); break;
+            case 'w': warmup = std::max(0, std::atoi(optarg)); break;
+            case 'r': repeat = std::max(1, std::atoi(optarg)); break;
+            case 'n': n_ctx = std::atoi(optarg); break;
+            case 'C': config_path = optarg; break;
+            case 'W': warm_caches = true; break;
+            case 'o': out_prefix = optarg; break;
+            case 'V': verbose = true; break;
+            case 'h': usage(argv[0]); return 0;
+            default:  usage(argv[0]); return 1;
+        }
+    }
+
+    if (model_specs.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    Config tuning;
+    if (!config_path.empty()) {
+        try {
+            tuning = parse_config_file(config_path);
+        } catch (const std::exception &e) {
+            std::cerr << "error: " << e.what() << "\n";
+            return 1;
+        }
+    }
+
+    std::vector<ModelSpec> models;
+    for (const auto &spec : model_specs) {
+        ModelSpec m;
+        if (!resolve_model(spec, models_dir, m)) return 1;
+        models.push_back(m);
+    }
+
+    const std::vector<BenchCase> cases = find_cases(prompts_dir, images_dir, filters);
+    if (cases.empty()) {
+        std::cerr << "error: no test cases found under " << prompts_dir << "\n";
+        return 1;
+    }
+
+    std::vector<CaseResult> results;
+    std::vector<std::pair<std::string, double>> loads;
+
+    for (const auto &m : models) {
+        std::cerr << "== " << m.name << " (" << cases.size() << " case(s), "
+                  << warmup << " warmup + " << repeat << " run(s) each) ==\n";
+
+        PiVisionConfig cfg;
+        cfg.n_ctx = 4096;
+        apply_config(cfg, tuning.doc);
+        cfg.model_path = m.model_path;
+        cfg.vision_path = m.vision_path;
+        if (n_ctx > 0) {
+            cfg.n_ctx = n_ctx;
+            cfg.auto_n_ctx = false;
+        }
+        if (!warm_caches) {
+            cfg.prompt_cache = false;
+            cfg.embd_cache_entries = 0;
+        }
+
+        auto load_start = std::chrono::steady_clock::now();
+        std::unique_ptr<PiVision> pv;
+        try {
+            pv = std::make_unique<PiVision>(cfg);
+        } catch (const std::exception &e) {
+            std::cerr << "error: " << e.what() << "\n";
+            continue;
+        }
+        loads.emplace_back(m.name, std::chrono::duration<double, std::milli>(
+                                       std::chrono::steady_clock::now() - load_start).count());
+
+        for (const auto &c : cases) {
+            CaseResult cr;
+            cr.model = m.name;
+            cr.name = c.name;
+
+            std::string e = m.vision_path.empty() ? std::string("no vision projector") : pv->validate({c.image_path});
+            if (!e.empty()) {
+                std::cerr << "  " << c.name << ": error: " << e << "\n";
+                cr.failed = warmup + repeat;
+                results.push_back(cr);
+                continue;
+            }
+
+            std::vector<double> ttft, prompt_tps, gen_tps, wall, sample;
+            for (int i = 0; i < warmup + repeat; ++i) {
+                const bool measured = i >= warmup;
+                RunResult r;
+                try {
+                    if (!pv->load_image(c.image_path))
+                        throw std::runtime_error("failed to load image: " + c.image_path);
+                    r = pv->run_collect(c.prompt);
+                } catch (const std::exception &ex) {
+                    pv->clear_images();
+                    std::cerr << "  " << c.name << ": error: " << ex.what() << "\n";
+                    ++cr.failed;
+                    continue;
+                }
+                if (verbose)
+                    fprintf(stderr, "  %s %s %d: ttft %.0f ms, gen %.1f tok/s, wall %.2f s\n",
+                            c.name.c_str(), measured ? "run" : "warmup", measured ? i - warmup + 1 : i + 1,
+                            r.ttft_ms, r.tokens_per_sec, r.wall_ms / 1000.0);
+                if (!measured) continue;
+
+                ttft.push_back(r.ttft_ms);
+                prompt_tps.push_back(r.prompt_ms > 0.0 ? r.prompt_tokens / (r.prompt_ms / 1000.0) : 0.0);
+                gen_tps.push_back(r.tokens_per_sec);
+                wall.push_back(r.wall_ms);
+                sample.push_back(r.gen_tokens > 0 ? r.sample_ms / r.gen_tokens : 0.0);
+            }
+
+            cr.runs = static_cast<int>(wall.size());
+            cr.ttft_ms = compute_stats(ttft);
+            cr.prompt_tps = compute_stats(prompt_tps);
+            cr.gen_tps = compute_stats(gen_tps);
+            cr.wall_ms = compute_stats(wall);
+            cr.sample_ms_per_token = compute_stats(sample);
+            results.push_back(cr);
+
+            fprintf(stderr, "  %-10s ttft %6.0f ms  prompt %6.1f tok/s  gen %5.1f tok/s  wall %6.2f s  (median of %d, p95 wall %.2f s)\n",
+                    c.name.c_str(), cr.ttft_ms.median, cr.prompt_tps.median, cr.gen_tps.median,
+                    cr.wall_ms.median / 1000.0, cr.runs, cr.wall_ms.p95 / 1000.0);
+        }
+    }
+
+    const std::string json_path = out_prefix + ".json";
+    const std::string csv_path = out_prefix + ".csv";
+    if (!write_json(json_path, results, loads, warmup, repeat) || !write_csv(csv_path, results)) {
+        std::cerr << "error: cannot write " << json_path << " / " << csv_path << "\n";
+        return 1;
+    }
+    std::cerr << "wrote " << json_path << " and " << csv_path << "\n";
+
+    for (const auto &r : results)
+        if (r.failed > 0) return 1;
+    return 0;
+}
@@ -0,0 +1,325 @@
+// config.cpp – PiVision JSON config files (see config.h)
+#include "config.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+
+[[noreturn]] static void bad_value(const std::string &key, const std::string &msg) {
+    throw std::runtime_error(key + ": " + msg);
+}
+
+// Rejects keys outside `known`, which are almost always typos
+static void check_keys(const json &obj, const std::string &prefix, std::initializer_list<const char *> known) {
+    for (auto it = obj.begin(); it != obj.end(); ++it) {
+        bool found = false;
+        for (const char *k : known)
+            if (it.key() == k) { found = true; break; }
+        if (!found)
+            bad_value(prefix + it.key(), "unknown setting");
+    }
+}
+
+static const json *find_object(const json &obj, const std::string &prefix, const char *key) {
+    auto it = obj.find(key);
+    if (it == obj.end()) return nullptr;
+    if (!it->is_object()) bad_value(prefix + key, "expected an object");
+    return &*it;
+}
+
+static bool read_int(const json &obj, const std::string &prefix, const char *key, int &out, int min_val) {
+    auto it = obj.find(key);
+    if (it == obj.end()) return false;
+    if (!it->is_number_integer()) bad_value(prefix + key, "expected an integer");
+    const long long v = it->get<long long>();
+    if (v < min_val || v > INT_MAX)
+        bad_value(prefix + key, "must be between " + std::to_string(min_val) + " and " + std::to_string(INT_MAX));
+    out = static_cast<int>(v);
+    return true;
+}
+
+static bool read_float(const json &obj, const std::string &prefix, const char *key, float &out,
+                       float min_val, float max_val) {
+    auto it = obj.find(key);
+    if (it == obj.end()) return false;
+    if (!it->is_number()) bad_value(prefix + key, "expected a number");
+    const double v = it->get<double>();
+    if (v < min_val || v > max_val)
+        bad_value(prefix + key, "must be between " + json(min_val).dump() + " and " + json(max_val).dump());
+    out = static_cast<float>(v);
+    return true;
+}
+
+static bool read_bool(const json &obj, const std::string &prefix, const char *key, bool &out) {
+    auto it = obj.find(key);
+    if (it == obj.end()) return false;
+    if (!it->is_boolean()) bad_value(prefix + key, "expected true or false");
+    out = it->get<bool>();
+    return true;
+}
+
+static bool read_string(const json &obj, const std::string &prefix, const char *key, std::string &out) {
+    auto it = obj.find(key);
+    if (it == obj.end()) return false;
+    if (!it->is_string()) bad_value(prefix + key, "expected a string");
+    out = it->get<std::string>();
+    return true;
+}
+
+// A number of cells or "auto" (largest context that fits in memory)
+static void read_n_ctx(const json &obj, const std::string &prefix, const char *key, PiVisionConfig &cfg) {
+    auto it = obj.find(key);
+    if (it == obj.end()) return;
+    if (it->is_string()) {
+        if (it->get<std::string>() != "auto") bad_value(prefix + key, "expected a number or \"auto\"");
+        cfg.auto_n_ctx = true;
+        return;
+    }
+    if (read_int(obj, prefix, key, cfg.n_ctx, 1))
+        cfg.auto_n_ctx = false;
+}
+
+// Pixels of the shorter image side, "auto" (projector input size) or "off"
+static void read_image_resize(const json &obj, const std::string &prefix, const char *key, PiVisionConfig &cfg) {
+    auto it = obj.find(key);
+    if (it == obj.end()) return;
+    if (it->is_string()) {
+        const std::string v = it->get<std::string>();
+        if (v == "auto") cfg.image_resize = 0;
+        else if (v == "off") cfg.image_resize = -1;
+        else bad_value(prefix + key, "expected a number, \"auto\" or \"off\"");
+        return;
+    }
+    read_int(obj, prefix, key, cfg.image_resize, 1);
+}
+
+// Soft limit alone enables the governor with the hard limit 5 °C above it
+static void read_thermal(const json &obj, const std::string &prefix, PiVisionConfig &cfg) {
+    const bool soft = read_float(obj, prefix, "soft_c", cfg.thermal_soft_c, 1.0f, 150.0f);
+    const bool hard = read_float(obj, prefix, "hard_c", cfg.thermal_hard_c, 1.0f, 150.0f);
+    if (soft && !hard)
+        cfg.thermal_hard_c = cfg.thermal_soft_c + 5.0f;
+    if (soft || hard)
+        cfg.thermal_governor = true;
+    if (cfg.thermal_governor && cfg.thermal_hard_c < cfg.thermal_soft_c)
+        bad_value(prefix + "hard_c", "must not be below " + prefix + "soft_c");
+}
+
+static void apply_performance(PiVisionConfig &cfg, const json &perf) {
+    const std::string p = "performance.";
+    check_keys(perf, p, {"n_ctx", "n_batch", "n_ubatch", "n_threads", "n_threads_batch", "n_threads_vision",
+                         "cpu_mask", "n_parallel", "n_draft", "use_mmap", "use_mlock", "prefetch", "warmup",
+                         "cache_type_k", "cache_type_v", "flash_attn", "check_memory", "memory_margin_mb",
+                         "prompt_cache", "max_pinned_prefixes", "embd_cache_entries", "image_resize", "thermal"});
+
+    read_n_ctx(perf, p, "n_ctx", cfg);
+    read_int(perf, p, "n_batch", cfg.n_batch, 1);
+    read_int(perf, p, "n_ubatch", cfg.n_ubatch, 1);
+    read_int(perf, p, "n_threads", cfg.n_threads, 0);
+    read_int(perf, p, "n_threads_batch", cfg.n_threads_batch, 0);
+    read_int(perf, p, "n_threads_vision", cfg.n_threads_vision, 0);
+    read_string(perf, p, "cpu_mask", cfg.cpu_mask);
+    read_int(perf, p, "n_parallel", cfg.n_parallel, 1);
+    read_int(perf, p, "n_draft", cfg.n_draft, 1);
+    read_bool(perf, p, "use_mmap", cfg.use_mmap);
+    read_bool(perf, p, "use_mlock", cfg.use_mlock);
+    read_bool(perf, p, "prefetch", cfg.prefetch);
+    read_bool(perf, p, "warmup", cfg.warmup);
+    read_string(perf, p, "cache_type_k", cfg.cache_type_k);
+    read_string(perf, p, "cache_type_v", cfg.cache_type_v);
+    read_string(perf, p, "flash_attn", cfg.flash_attn);
+    read_bool(perf, p, "check_memory", cfg.check_memory);
+    read_int(perf, p, "memory_margin_mb", cfg.memory_margin_mb, 0);
+    read_bool(perf, p, "prompt_cache", cfg.prompt_cache);
+    read_int(perf, p, "max_pinned_prefixes", cfg.max_pinned_prefixes, 0);
+    read_int(perf, p, "embd_cache_entries", cfg.embd_cache_entries, 0);
+    read_image_resize(perf, p, "image_resize", cfg);
+
+    if (const json *thermal = find_object(perf, p, "thermal")) {
+        const std::string t = p + "thermal.";
+        check_keys(*thermal, t, {"enabled", "zone", "soft_c", "hard_c", "sample_ms", "min_threads"});
+        cfg.thermal_governor = true;
+        read_string(*thermal, t, "zone", cfg.thermal_zone);
+        read_int(*thermal, t, "sample_ms", cfg.thermal_sample_ms, 1);
+        read_int(*thermal, t, "min_threads", cfg.thermal_min_threads, 1);
+        read_thermal(*thermal, t, cfg);
+        read_bool(*thermal, t, "enabled", cfg.thermal_governor);
+    }
+}
+
+static void apply_sampler(PiVisionConfig &cfg, const json &sampler) {
+    const std::string p = "sampler.";
+    check_keys(sampler, p, {"greedy", "temperature", "top_k", "top_p", "min_p",
+                            "repeat_penalty", "repeat_last_n", "seed"});
+    read_float(sampler, p, "temperature", cfg.temperature, 0.0f, 5.0f);
+    read_int(sampler, p, "top_k", cfg.top_k, 0);
+    read_float(sampler, p, "top_p", cfg.top_p, 0.0f, 1.0f);
+    read_float(sampler, p, "min_p", cfg.min_p, 0.0f, 1.0f);
+    read_float(sampler, p, "repeat_penalty", cfg.repeat_penalty, 0.0f, 10.0f);
+    read_int(sampler, p, "repeat_last_n", cfg.repeat_last_n, 0);
+    read_int(sampler, p, "seed", cfg.seed, -1);
+
+    // "greedy": true is temperature 0, whatever the temperature says
+    bool greedy = false;
+    if (read_bool(sampler, p, "greedy", greedy) && greedy)
+        cfg.temperature = 0.0f;
+}
+
+static std::string read_file(const std::string &key, const std::string &path) {
+    std::ifstream f(path);
+    if (!f) bad_value(key, "cannot read " + path);
+    return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+void apply_generation(GenerationParams &gen, const json &doc) {
+    const json *block = find_object(doc, "", "generation");
+    if (!block) return;
+
+    const std::string p = "generation.";
+    check_keys(*block, p, {"max_tokens", "max_wall_ms", "stop", "grammar", "grammar_file", "json_schema"});
+    read_int(*block, p, "max_tokens", gen.max_tokens, 0);
+    read_int(*block, p, "max_wall_ms", gen.max_wall_ms, 0);
+
+    auto stop = block->find("stop");
+    if (stop != block->end()) {
+        if (stop->is_string())
+            gen.stop = {stop->get<std::string>()};
+        else if (stop->is_array() && std::all_of(stop->begin(), stop->end(), [](const json &v) { return v.is_string(); }))
+            gen.stop = stop->get<std::vector<std::string>>();
+        else
+            bad_value(p + "stop", "expected a string or a list of strings");
+    }
+
+    // A grammar or schema replaces whatever constraint a lower layer set
+    std::string text;
+    if (read_string(*block, p, "grammar", text)) {
+        gen.grammar = text;
+        gen.json_schema.clear();
+    }
+    if (read_string(*block, p, "grammar_file", text)) {
+        gen.grammar = read_file(p + "grammar_file", text);
+        gen.json_schema.clear();
+    }
+    auto schema = block->find("json_schema");
+    if (schema != block->end()) {
+        json parsed;
+        if (schema->is_object()) {
+            parsed = *schema;
+        } else if (schema->is_string()) {
+            const std::string path = schema->get<std::string>();
+            parsed = json::parse(read_file(p + "json_schema", path), nullptr, false);
+            if (!parsed.is_object()) bad_value(p + "json_schema", path + " does not hold a JSON object");
+        } else {
+            bad_value(p + "json_schema", "expected a schema object or a file name");
+        }
+        gen.json_schema = parsed.dump();
+        gen.grammar.clear();
+    }
+    if (!gen.grammar.empty() && !gen.json_schema.empty())
+        bad_value(p + "grammar", "cannot be combined with json_schema");
+}
+
+void apply_config(PiVisionConfig &cfg, const json &doc) {
+    if (!doc.is_object())
+        throw std::runtime_error("expected a JSON object");
+    check_keys(doc, "", {"comment", "model_path", "vision_path", "default_image_path", "prompt", "log_directory",
+                         "default_n_ctx", "draft_model_path", "embd_cache_dir", "context_policy",
+                         "performance", "sampler", "generation", "models", "pool_memory_mb"});
+
+    read_n_ctx(doc, "", "default_n_ctx", cfg);
+    read_string(doc, "", "draft_model_path", cfg.draft_model_path);
+    read_string(doc, "", "embd_cache_dir", cfg.embd_cache_dir);
+    read_string(doc, "", "context_policy", cfg.context_policy);
+
+    if (const json *perf = find_object(doc, "", "performance"))
+        apply_performance(cfg, *perf);
+    if (const json *sampler = find_object(doc, "", "sampler"))
+        apply_sampler(cfg, *sampler);
+}
+
+// The "models" block: name -> { model_path, vision_path }
+static void read_models(Config &cfg) {
+    read_int(cfg.doc, "", "pool_memory_mb", cfg.pool_memory_mb, 0);
+    const json *models = find_object(cfg.doc, "", "models");
+    if (!models) return;
+
+    for (auto it = models->begin(); it != models->end(); ++it) {
+        const std::string p = "models." + it.key() + ".";
+        if (!it->is_object()) bad_value("models." + it.key(), "expected an object");
+        check_keys(*it, p, {"model_path", "vision_path"});
+
+        ModelEntry m;
+        m.name = it.key();
+        if (!read_string(*it, p, "model_path", m.model_path))
+            bad_value(p + "model_path", "missing");
+        read_string(*it, p, "vision_path", m.vision_path);
+        cfg.models.push_back(std::move(m));
+    }
+}
+
+Config parse_config_file(const std::string &path) {
+    std::ifstream f(path);
+    if (!f)
+        throw std::runtime_error("config " + path + ": cannot open file");
+
+    Config cfg;
+    cfg.source = path;
+    try {
+        // Comments are accepted so example configs can be annotated
+        cfg.doc = json::parse(f, nullptr, true, true);
+
+        // Validated up front so a bad setting names the file before any model loads
+        PiVisionConfig scratch;
+        apply_config(scratch, cfg.doc);
+        GenerationParams scratch_gen;
+        apply_generation(scratch_gen, cfg.doc);
+
+        read_string(cfg.doc, "", "model_path", cfg.model_path);
+        read_string(cfg.doc, "", "vision_path", cfg.vision_path);
+        read_string(cfg.doc, "", "prompt", cfg.prompt);
+        read_string(cfg.doc, "", "default_image_path", cfg.default_image_path);
+        read_string(cfg.doc, "", "log_directory", cfg.log_directory);
+        read_models(cfg);
+    } catch (const json::exception &e) {
+        throw std::runtime_error("config " + path + ": " + e.what());
+    } catch (const std::runtime_error &e) {
+        throw std::runtime_error("config " + path + ": " + e.what());
+    }
+    return cfg;
+}
+
+std::string find_config_file() {
+    if (fs::exists("./pivision.json"))
+        return "./pivision.json";
+
+    const char *home = getenv("HOME");
+    if (home) {
+        fs::path user_cfg = fs::path(home) / ".config" / "pivision" / "config.json";
+        if (fs::exists(user_cfg))
+            return user_cfg.string();
+    }
+
+    if (fs::exists("/etc/pivision/config.json"))
+        return "/etc/pivision/config.json";
+
+    return "";
+}
+
+// Priority: explicit --config > ./pivision.json > ~/.config > /etc
+Config load_config(const std::string &explicit_path) {
+    if (!explicit_path.empty()) {
+        if (fs::exists(explicit_path))
+            return parse_config_file(explicit_path);
+        std::cerr << "warning: config file not found: " << explicit_path << "\n";
+    }
+
+    const std::string path = find_config_file();
+    return path.empty() ? Config{} : parse_config_file(path);
+}
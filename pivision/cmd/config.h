@@ -0,0 +1,87 @@
+// config.h – PiVision JSON config files, shared by the command line tools.
+//
+// A config describes one case (model, projector, image, prompt, log directory)
+// and optionally tunes it:
+//
+//   {
+//     "model_path": "...", "vision_path": "...", "prompt": "...",
+//     "default_n_ctx": 4096,
+//     "performance": { "n_threads": 4, "n_batch": 256, "cache_type_k": "q8_0",
+//                      "thermal": { "soft_c": 75 } },
+//     "sampler": { "temperature": 0.2, "top_k": 40, "seed": 7 },
+//     "generation": { "max_tokens": 256, "max_wall_ms": 30000, "stop": ["\n\n"] }
+//   }
+//
+// The tuning keys map onto PiVisionConfig (see apply_config()), the generation
+// block onto the GenerationParams of every request (see apply_generation()).
+//
+// A daemon config can also name further models that clients pick per request,
+// kept loaded together in a PiVisionPool within pool_memory_mb:
+//
+//   "models": { "gemma-3-12b": { "model_path": "...", "vision_path": "..." } },
+//   "pool_memory_mb": 7000
+#pragma once
+
+#include "pivision.h"
+
+#include <nlohmann/json.hpp>
+
+#include <string>
+#include <vector>
+
+// One entry of the "models" block
+struct ModelEntry {
+    std::string name;
+    std::string model_path;
+    std::string vision_path;
+};
+
+struct Config {
+    std::string model_path;
+    std::string vision_path;
+    std::string prompt;               // prompt text, or a file holding it
+    std::string default_image_path;
+    std::string log_directory;
+    std::vector<ModelEntry> models;   // named models a daemon can serve
+    int pool_memory_mb = 0;           // cap on the models loaded together; 0 = MemAvailable
+    std::string source;               // file the config was read from; empty if none
+    nlohmann::json doc = nlohmann::json::object();  // whole document, for apply_config()
+};
+
+// Reads and validates a config file. Throws std::runtime_error naming the
+// file and the offending key when it is not valid JSON or a setting has the
+// wrong type or range.
+Config parse_config_file(const std::string &path);
+
+// ./pivision.json, ~/.config/pivision/config.json or /etc/pivision/config.json,
+// whichever exists first; empty if none does
+std::string find_config_file();
+
+// explicit_path (warns when missing) or else find_config_file(); an empty
+// Config when there is no file
+Config load_config(const std::string &explicit_path = "");
+
+// Applies the tuning settings of a config document onto cfg, leaving
+// everything the document does not mention untouched, so documents can be
+// layered (defaults < config file < command line). Case keys (model_path,
+// prompt, ...) are not applied. Throws std::runtime_error on invalid values.
+//
+//   top level:   default_n_ctx, draft_model_path, embd_cache_dir, context_policy
+//   performance: n_ctx (number or "auto"), n_batch, n_ubatch, n_threads,
+//                n_threads_batch, n_threads_vision, cpu_mask, n_parallel,
+//                n_draft, use_mmap, use_mlock, prefetch, warmup, cache_type_k,
+//                cache_type_v, flash_attn, check_memory, memory_margin_mb,
+//                prompt_cache, max_pinned_prefixes, embd_cache_entries,
+//                image_resize (pixels, "auto" or "off"),
+//                thermal { enabled, zone, soft_c, hard_c, sample_ms, min_threads }
+//   sampler:     greedy, temperature, top_k, top_p, min_p, repeat_penalty,
+//                repeat_last_n, seed (-1 = random)
+void apply_config(PiVisionConfig &cfg, const nlohmann::json &doc);
+
+// Applies the generation block of a config document onto gen, layered the
+// same way as apply_config():
+//
+//   generation:  max_tokens, max_wall_ms, stop (a string or a list of them), grammar (GBNF
+//                text), grammar_file, json_schema (a schema object, or a file
+//                holding one)
+void apply_generation(GenerationParams &gen, const nlohmann::json &doc);
@@ -1,4 +1,6 @@
 // log_to_csv.cpp – Scrape PiVision session log directory and export to CSV.
+#include "config.h"
+
 #include <algorithm>
 #include <cstdlib>
 #include <filesystem>
@@ -10,24 +12,6 @@
 
 namespace fs = std::filesystem;
 
-static std::string json_get_string(const std::string& json, const std::string& key) {
-    std::string pattern = "\"" + key + "\"";
-    size_t pos = json.find(pattern);
-    if (pos == std::string::npos) return "";
-
-    pos = json.find(':', pos);
-    if (pos == std::string::npos) return "";
-
-    pos = json.find('"', pos + 1);
-    if (pos == std::string::npos) return "";
-
-    size_t start = pos + 1;
-    size_t end = json.find('"', start);
-    if (end == std::string::npos) return "";
-
-    return json.substr(start, end - start);
-}
-
 static std::string get_default_log_dir() {
 #ifdef _WIN32
     const char* home = std::getenv("USERPROFILE");
@@ -39,37 +23,16 @@ static std::string get_default_log_dir() {
     return (fs::path(home) / "pivision_logs").string();
 }
 
-static std::string load_log_directory_from_config(const std::string& config_path) {
-    if (config_path.empty() || !fs::exists(config_path)) return "";
-    std::ifstream f(config_path);
-    if (!f) return "";
-    std::string json((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
-    return json_get_string(json, "log_directory");
-}
-
+// --log-dir > log_directory of --config (or the config pivision itself would
+// find) > ~/pivision_logs
 static std::string resolve_log_dir(const std::string& explicit_log_dir,
                                    const std::string& config_path) {
     if (!explicit_log_dir.empty()) return explicit_log_dir;
-    std::string from_config = load_log_directory_from_config(config_path);
-    if (!from_config.empty()) return from_config;
-    
-    if (config_path.empty()) {
-        if (fs::exists("./pivision.json"))
-            from_config = load_log_directory_from_config("./pivision.json");
-        if (from_config.empty()) {
-#ifdef _WIN32
-            const char* home = std::getenv("USERPROFILE");
-            if (!home) home = std::getenv("HOME");
-#else
-            const char* home = std::getenv("HOME");
-#endif
-            if (home) {
-                fs::path user_cfg = fs::path(home) / ".config" / "pivision" / "config.json";
-                if (fs::exists(user_cfg))
-                    from_config = load_log_directory_from_config(user_cfg.string());
-            }
-        }
-        if (!from_config.empty()) return from_config;
+
+    std::string path = config_path.empty() ? find_config_file() : config_path;
+    if (!path.empty() && fs::exists(path)) {
+        Config cfg = parse_config_file(path);
+        if (!cfg.log_directory.empty()) return cfg.log_directory;
     }
     return get_default_log_dir();
 }
@@ -87,7 +50,26 @@ struct SessionRecord {
     double      prompt_ms         = 0.0;
     double      gen_ms            = 0.0;
     double      ttft_ms           = 0.0;
+    double      image_decode_ms   = 0.0;  // summed over images
+    double      image_resize_ms   = 0.0;  // summed over images
+    double      image_peak_mb     = 0.0;
+    double      image_wait_ms     = 0.0;
+    double      tokenize_ms       = 0.0;
+    double      encode_ms         = 0.0;
+    double      image_embd_ms     = 0.0;
+    double      prefill_ms        = 0.0;
+    double      sample_ms         = 0.0;
+    double      detok_ms          = 0.0;
+    std::string kv_cache;                 // "q8_0/q8_0"
+    double      kv_cache_mb       = 0.0;
+    std::string flash_attn;
+    std::string stop_reason;
+    std::string sampler;
+    double      temp_max_c        = 0.0;
+    int         thermal_actions   = 0;
+    double      thermal_pause_ms  = 0.0;
     double      wall_sec          = 0.0;
+    double      load_sec          = 0.0;
     std::string response;
 };
 
@@ -126,6 +108,13 @@ static bool parse_int(const std::string& s, int& out) {
     }
 }
 
+// "12.5 ms" -> 12.5, "78.2 C" -> 78.2
+static bool parse_with_unit(std::string s, double& out) {
+    size_t sp = s.find(' ');
+    if (sp != std::string::npos) s = s.substr(0, sp);
+    return parse_double(s, out);
+}
+
 static bool parse_log_file(const fs::path& path, SessionRecord& out) {
     std::ifstream f(path);
     if (!f) return false;
@@ -245,10 +234,62 @@ static bool parse_log_file(const fs::path& path, SessionRecord& out) {
                 size_t sp = v.find(' ');
                 if (sp != std::string::npos) v = v.substr(0, sp);
                 parse_double(v, out.ttft_ms);
+            } else if (!(v = parse_value_line(line, "Image decode times")).empty()) {
+                // "120, 95 ms"
+                std::istringstream is(v);
+                std::string item;
+                while (std::getline(is, item, ',')) {
+                    double ms = 0.0;
+                    if (parse_with_unit(trim(item), ms)) out.image_decode_ms += ms;
+                }
+            } else if (!(v = parse_value_line(line, "Image resize times")).empty()) {
+                std::istringstream is(v);
+                std::string item;
+                while (std::getline(is, item, ',')) {
+                    double ms = 0.0;
+                    if (parse_with_unit(trim(item), ms)) out.image_resize_ms += ms;
+                }
+            } else if (!(v = parse_value_line(line, "Image buffer peak")).empty()) {
+                parse_with_unit(v, out.image_peak_mb);
+            } else if (!(v = parse_value_line(line, "Image decode wait")).empty()) {
+                parse_with_unit(v, out.image_wait_ms);
+            } else if (!(v = parse_value_line(line, "Tokenize time")).empty()) {
+                parse_with_unit(v, out.tokenize_ms);
+            } else if (!(v = parse_value_line(line, "Vision encode time")).empty()) {
+                parse_with_unit(v, out.encode_ms);
+            } else if (!(v = parse_value_line(line, "Image embedding decode time")).empty()) {
+                parse_with_unit(v, out.image_embd_ms);
+            } else if (!(v = parse_value_line(line, "Text prefill time")).empty()) {
+                parse_with_unit(v, out.prefill_ms);
+            } else if (!(v = parse_value_line(line, "Sampling time")).empty()) {
+                parse_with_unit(v, out.sample_ms);
+            } else if (!(v = parse_value_line(line, "Detokenize time")).empty()) {
+                parse_with_unit(v, out.detok_ms);
+            } else if (!(v = parse_value_line(line, "KV cache")).empty()) {
+                // "q8_0/q8_0 312.0 MB"
+                size_t sp = v.find(' ');
+                out.kv_cache = v.substr(0, sp);
+                if (sp != std::string::npos) parse_with_unit(trim(v.substr(sp)), out.kv_cache_mb);
+            } else if (!(v = parse_value_line(line, "Flash attention")).empty()) {
+                out.flash_attn = v;
+            } else if (!(v = parse_value_line(line, "Stop reason")).empty()) {
+                out.stop_reason = v;
+            } else if (!(v = parse_value_line(line, "Sampler")).empty()) {
+                out.sampler = v;
+            } else if (!(v = parse_value_line(line, "Max temperature")).empty()) {
+                parse_with_unit(v, out.temp_max_c);
+            } else if (!(v = parse_value_line(line, "Thermal actions")).empty()) {
+                parse_int(v, out.thermal_actions);
+            } else if (!(v = parse_value_line(line, "Thermal pause")).empty()) {
+                parse_with_unit(v, out.thermal_pause_ms);
             } else if (!(v = parse_value_line(line, "Total wall time")).empty()) {
                 size_t sp = v.find(' ');
                 if (sp != std::string::npos) v = v.substr(0, sp);
                 parse_double(v, out.wall_sec);
+            } else if (!(v = parse_value_line(line, "Model load time")).empty()) {
+                size_t sp = v.find(' ');
+                if (sp != std::string::npos) v = v.substr(0, sp);
+                parse_double(v, out.load_sec);
             }
             continue;
         }
@@ -292,7 +333,26 @@ static void write_csv_row(std::ostream& out, const SessionRecord& r) {
         << "," << r.prompt_ms
         << "," << r.gen_ms
         << "," << r.ttft_ms
+        << "," << r.image_decode_ms
+        << "," << r.image_resize_ms
+        << "," << r.image_peak_mb
+        << "," << r.image_wait_ms
+        << "," << r.tokenize_ms
+        << "," << r.encode_ms
+        << "," << r.image_embd_ms
+        << "," << r.prefill_ms
+        << "," << r.sample_ms
+        << "," << r.detok_ms
+        << "," << csv_escape(r.kv_cache)
+        << "," << r.kv_cache_mb
+        << "," << csv_escape(r.flash_attn)
+        << "," << csv_escape(r.stop_reason)
+        << "," << csv_escape(r.sampler)
+        << "," << r.temp_max_c
+        << "," << r.thermal_actions
+        << "," << r.thermal_pause_ms
         << "," << r.wall_sec
+        << "," << r.load_sec
         << "," << csv_escape(r.response)
         << "\n";
 }
@@ -343,7 +403,13 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    std::string resolved = resolve_log_dir(log_dir, config_path);
+    std::string resolved;
+    try {
+        resolved = resolve_log_dir(log_dir, config_path);
+    } catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << "\n";
+        return 1;
+    }
     if (resolved.empty()) {
         std::cerr << "error: could not determine log directory. Set --log-dir or ensure HOME/USERPROFILE and pivision log_directory are set.\n";
         return 1;
@@ -387,7 +453,10 @@ int main(int argc, char* argv[]) {
 
     csv << "timestamp,model_description,images_processed,image_paths,prompt,"
         << "tokens_per_sec,prompt_tokens,gen_tokens,total_tokens,"
-        << "prompt_ms,gen_ms,ttft_ms,wall_sec,response\n";
+        << "prompt_ms,gen_ms,ttft_ms,image_decode_ms,image_resize_ms,image_peak_mb,image_wait_ms,"
+        << "tokenize_ms,encode_ms,image_embd_ms,prefill_ms,sample_ms,detok_ms,"
+        << "kv_cache,kv_cache_mb,flash_attn,stop_reason,sampler,temp_max_c,thermal_actions,thermal_pause_ms,"
+        << "wall_sec,load_sec,response\n";
 
     for (const auto& r : records)
         write_csv_row(csv, r);
@@ -1,15 +1,32 @@
 #include "pivision.h"
+#include "config.h"
 
 #include <getopt.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include <sys/utsname.h>
+#include <unistd.h>
 #include <algorithm>
+#include <cctype>
+#include <cerrno>
 #include <chrono>
+#include <csignal>
+#include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -20,92 +37,9 @@ static const char* BUILTIN_MODEL  = "/home/jplpi/llama.cpp/models/gemma-3-4b-it-
 static const char* BUILTIN_VISION = "/home/jplpi/llama.cpp/models/mmproj-model-f16-4B.gguf";
 static const int BUILTIN_N_CTX  = 4096;
 
-struct Config {
-    std::string model_path;
-    std::string vision_path;
-    std::string prompt;
-    std::string default_image_path;
-    int default_n_ctx = 0;
-    std::string log_directory;
-    std::string source;
-};
-
-static std::string json_get_string(const std::string &json, const std::string &key) {
-    std::string pattern = "\"" + key + "\"";
-    size_t pos = json.find(pattern);
-    if (pos == std::string::npos) return "";
-
-    pos = json.find(':', pos);
-    if (pos == std::string::npos) return "";
-
-    pos = json.find('"', pos + 1);
-    if (pos == std::string::npos) return "";
-
-    size_t start = pos + 1;
-    size_t end = json.find('"', start);
-    if (end == std::string::npos) return "";
-
-    return json.substr(start, end - start);
-}
-
-static int json_get_int(const std::string &json, const std::string &key, int default_val = 0) {
-    std::string pattern = "\"" + key + "\"";
-    size_t pos = json.find(pattern);
-    if (pos == std::string::npos) return default_val;
-
-    pos = json.find(':', pos);
-    if (pos == std::string::npos) return default_val;
-
-    pos++;
-    while (pos < json.size() && (json[pos] == ' ' || json[pos] == '\t')) pos++;
-
-    if (pos >= json.size() || !isdigit(json[pos])) return default_val;
-
-    return std::stoi(json.substr(pos));
-}
-
-static Config parse_config_file(const fs::path &path) {
-    Config cfg;
-    std::ifstream f(path);
-    if (!f) return cfg;
-
-    std::string json((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
-
-    cfg.model_path = json_get_string(json, "model_path");
-    cfg.vision_path = json_get_string(json, "vision_path");
-    cfg.default_image_path = json_get_string(json, "default_image_path");
-    cfg.default_n_ctx = json_get_int(json, "default_n_ctx", 0);
-    cfg.log_directory = json_get_string(json, "log_directory");
-    cfg.prompt = json_get_string(json, "prompt");
-    cfg.source = path.string();
-
-    return cfg;
-}
-
-// Priority: explicit --config > ./pivision.json > ~/.config > /etc
-static Config load_config(const std::string &explicit_path = "") {
-    if (!explicit_path.empty()) {
-        if (!fs::exists(explicit_path))
-            std::cerr << "warning: config file not found: " << explicit_path << "\n";
-        else
-            return parse_config_file(explicit_path);
-    }
-
-    if (fs::exists("./pivision.json"))
-        return parse_config_file("./pivision.json");
-
-    const char *home = getenv("HOME");
-    if (home) {
-        fs::path user_cfg = fs::path(home) / ".config" / "pivision" / "config.json";
-        if (fs::exists(user_cfg))
-            return parse_config_file(user_cfg);
-    }
-
-    if (fs::exists("/etc/pivision/config.json"))
-        return parse_config_file("/etc/pivision/config.json");
-
-    return Config{};
-}
+static const char* DEFAULT_SOCKET = "/tmp/pivision.sock";
+// A daemon client that sends or reads nothing for this long is dropped
+static const int CLIENT_TIMEOUT_S = 30;
 
 static void usage(const char *prog) {
     std::cerr
@@ -113,15 +47,62 @@ static void usage(const char *prog) {
         << "  " << prog << " --prompt <text> [options]          Single-shot mode\n"
         << "  " << prog << " --chat [--prompt <text>] [options] Interactive chat\n"
         << "  " << prog << " --check-health                     Verify system health\n"
+        << "  " << prog << " --serve [--socket <path>] [options] Keep the model resident and serve requests\n"
+        << "  " << prog << " --socket <path> --prompt <text>    Forward a request to a running daemon\n"
+        << "  " << prog << " --batch <manifest> [options]       Run many configs, loading each model once\n"
         << "\nOptions:\n"
         << "  --model <llm.gguf>     LLM model\n"
         << "  --vision <proj.gguf>   Vision projector\n"
-        << "  --image <img>          Image file (repeatable)\n"
+        << "  --image <img>          Image file, or - to read one from stdin (repeatable; FIFOs work too)\n"
         << "  --prompt <text>        Initial prompt (in chat mode, processed first)\n"
         << "  --config <file>        Config file path\n"
         << "  --json                 JSON output (single-shot only)\n"
+        << "  --json-stream          NDJSON output: one line per generated piece, then the result\n"
         << "  --verbose              Print stats (wall time, TTFT, tok/s)\n"
         << "  --check-health         Check system thermal, RAM, and library status\n"
+        << "  --serve                Run as a daemon on a Unix-domain socket\n"
+        << "  --socket <path>        Daemon socket (default: " << DEFAULT_SOCKET << ")\n"
+        << "  --model-name <name>    --socket: run on the daemon's model <name> (config \"models\" block)\n"
+        << "  --pool-mb <n>          --serve: memory for the models loaded at once; least recently used\n"
+        << "                         ones are unloaded to make room (default: config pool_memory_mb, else RAM)\n"
+        << "  --batch <manifest>     Directory of config *.json, or a file listing one config per line\n"
+        << "  --watch <dir>          Keep the model loaded and run the prompt on every JPG/PNG written to <dir>\n"
+        << "  --watch-out <dir>      Write each <image>.json result to <dir> (default: next to the image)\n"
+        << "  --watch-queue <n>      Frames waiting at most; older ones are dropped (default: 8)\n"
+        << "  --embd-cache-dir <dir> Persist encoded image embeddings so repeat images skip the encoder\n"
+        << "  --context-policy <p>   Chat context overflow: sliding_window (default) or none\n"
+        << "  --threads <n>          Generation threads\n"
+        << "  --threads-batch <n>    Prompt prefill threads (default: --threads)\n"
+        << "  --threads-vision <n>   Vision encoder threads (default: --threads-batch)\n"
+        << "  --cpu-mask <cpus>      Pin inference to CPUs, e.g. 0-3,6 or 0xf\n"
+        << "  --draft-model <gguf>   Small same-vocabulary model for speculative decoding\n"
+        << "  --draft <n>            Tokens proposed per draft step (default: 8)\n"
+        << "  --parallel <n>         --batch: run up to n cases of a model concurrently (default: 1)\n"
+        << "  --pin-prefix <file>    Keep the KV cache of a shared prompt head resident (serve/batch, repeatable)\n"
+        << "  --no-mmap              Read the weights into memory instead of mapping the file\n"
+        << "  --mlock                Lock the weights in RAM\n"
+        << "  --prefetch             Start readahead of the model files before loading them\n"
+        << "  --warmup               Run one throwaway decode at startup\n"
+        << "  --n-ctx <n|auto>       Context size (default: config default_n_ctx, else 2048); auto = largest that fits in RAM\n"
+        << "  --cache-type-k <t>     KV cache K type: f16 (default), bf16, q8_0, q5_1, q5_0, q4_1, q4_0\n"
+        << "  --cache-type-v <t>     KV cache V type (quantized types need flash attention)\n"
+        << "  --flash-attn <mode>    auto (default), on or off\n"
+        << "  --no-memory-check      Load even when the estimated memory use exceeds MemAvailable\n"
+        << "  --thermal-limit <c>    Throttle generation above <c> °C (<soft>,<hard>; hard defaults to soft+5)\n"
+        << "  --image-resize <px>    Shrink large images to a shorter side of px on decode\n"
+        << "                         (default auto = the projector's input size; off = full resolution)\n"
+        << "  --max-tokens <n>       Stop the reply after n tokens\n"
+        << "  --max-wall-ms <ms>     Stop the reply once the request has run for ms milliseconds\n"
+        << "  --stop <str>           Stop the reply before <str> (repeatable)\n"
+        << "  --grammar-file <file>  Constrain the reply to a GBNF grammar\n"
+        << "  --json-schema <s>      Constrain the reply to a JSON schema (inline JSON or a file)\n"
+        << "  --temp <t>             Sampling temperature (default 0.1; 0 = greedy)\n"
+        << "  --greedy               Always pick the most likely token (same as --temp 0)\n"
+        << "  --top-k <n>            Sample from the n most likely tokens (default 40; 0 = off)\n"
+        << "  --top-p <p>            Nucleus sampling threshold (default 0.95; 1 = off)\n"
+        << "  --min-p <p>            Drop tokens below p times the top probability (default off)\n"
+        << "  --repeat-penalty <f>   Penalize the last 64 tokens (default 1.0 = off)\n"
+        << "  --seed <n>             Sampling seed (default 42; -1 = random)\n"
         << "\nConfig file priority:\n"
         << "  1. --config <path>              (explicit)\n"
         << "  2. ./pivision.json              (local directory)\n"
@@ -130,6 +111,8 @@ static void usage(const char *prog) {
         << "\nChat commands:\n"
         << "  /image <path>          Load an image for the next message\n"
         << "  /clear                 Reset conversation\n"
+        << "  /save <file>           Save the conversation and its KV cache\n"
+        << "  /load <file>           Resume a saved conversation\n"
         << "  /quit                  Exit\n";
 }
 
@@ -160,13 +143,36 @@ static void print_json_error(const std::string &msg) {
     std::cout << "{\"error\":\"" << json_escape(msg) << "\"}\n";
 }
 
+static std::string strprintf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    va_list ap2;
+    va_copy(ap2, ap);
+    int n = vsnprintf(nullptr, 0, fmt, ap);
+    va_end(ap);
+
+    std::string out(n > 0 ? static_cast<size_t>(n) : 0, '\0');
+    if (n > 0) vsnprintf(&out[0], out.size() + 1, fmt, ap2);
+    va_end(ap2);
+    return out;
+}
+
+// "85, 92 ms" for a list of per-image times
+static std::string join_ms(const std::vector<double> &ms, const char *sep) {
+    std::string out;
+    for (size_t i = 0; i < ms.size(); ++i)
+        out += strprintf("%s%.0f", i ? sep : "", ms[i]);
+    return out;
+}
+
 static std::string g_log_directory;
 
-static void save_log(const std::string &prompt, const std::vector<std::string> &images, const RunResult &r)
+static void save_log(const std::string &prompt, const std::vector<std::string> &images, const RunResult &r,
+                     const std::string &log_directory = g_log_directory)
 {
     fs::path log_dir;
-    if (!g_log_directory.empty()) {
-        log_dir = g_log_directory;
+    if (!log_directory.empty()) {
+        log_dir = log_directory;
     } else {
         const char *home = getenv("HOME");
         if (!home) return;
@@ -180,8 +186,12 @@ static void save_log(const std::string &prompt, const std::vector<std::string> &
     std::tm tm{};
     localtime_r(&tt, &tm);
 
-    char fname[48];
-    std::strftime(fname, sizeof(fname), "session_%Y%m%d_%H%M%S.log", &tm);
+    // Millisecond suffix keeps back-to-back requests (daemon mode) from sharing a file
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
+    char stamp[32];
+    std::strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", &tm);
+    char fname[64];
+    snprintf(fname, sizeof(fname), "session_%s_%03d.log", stamp, static_cast<int>(ms));
 
     std::ofstream f(log_dir / fname);
     if (!f) return;
@@ -214,6 +224,8 @@ static void save_log(const std::string &prompt, const std::vector<std::string> &
     f << "Tokens/sec (generation): " << buf << "\n";
     f << "Prompt tokens: " << r.prompt_tokens << "\n";
     f << "Generated tokens: " << r.gen_tokens << "\n";
+    if (!r.stop_reason.empty())
+        f << "Stop reason: " << r.stop_reason << "\n";
     f << "Total tokens: " << r.total_tokens << "\n";
     snprintf(buf, sizeof(buf), "%.1f", r.prompt_ms);
     f << "Prompt eval time: " << buf << " ms\n";
@@ -221,8 +233,52 @@ static void save_log(const std::string &prompt, const std::vector<std::string> &
     f << "Generation time: " << buf << " ms\n";
     snprintf(buf, sizeof(buf), "%.1f", r.ttft_ms);
     f << "Time to first token: " << buf << " ms\n";
+    if (!r.image_decode_ms.empty()) {
+        f << "Image decode times: " << join_ms(r.image_decode_ms, ", ") << " ms\n";
+        f << "Image resize times: " << join_ms(r.image_resize_ms, ", ") << " ms\n";
+        snprintf(buf, sizeof(buf), "%.1f", r.image_peak_bytes / (1024.0 * 1024.0));
+        f << "Image buffer peak: " << buf << " MB\n";
+        snprintf(buf, sizeof(buf), "%.1f", r.image_wait_ms);
+        f << "Image decode wait: " << buf << " ms\n";
+    }
+    snprintf(buf, sizeof(buf), "%.1f", r.tokenize_ms);
+    f << "Tokenize time: " << buf << " ms\n";
+    snprintf(buf, sizeof(buf), "%.1f", r.encode_ms);
+    f << "Vision encode time: " << buf << " ms\n";
+    snprintf(buf, sizeof(buf), "%.1f", r.image_embd_ms);
+    f << "Image embedding decode time: " << buf << " ms\n";
+    snprintf(buf, sizeof(buf), "%.1f", r.prefill_ms);
+    f << "Text prefill time: " << buf << " ms\n";
+    snprintf(buf, sizeof(buf), "%.1f", r.sample_ms);
+    f << "Sampling time: " << buf << " ms\n";
+    if (!r.sampler.empty())
+        f << "Sampler: " << r.sampler << "\n";
+    snprintf(buf, sizeof(buf), "%.1f", r.detok_ms);
+    f << "Detokenize time: " << buf << " ms\n";
+    snprintf(buf, sizeof(buf), "%.1f", r.kv_bytes / (1024.0 * 1024.0));
+    f << "KV cache: " << r.kv_type_k << "/" << r.kv_type_v << " " << buf << " MB\n";
+    f << "Flash attention: " << r.flash_attn << "\n";
+    if (!r.thermal_trace.empty()) {
+        snprintf(buf, sizeof(buf), "%.1f", r.temp_max_c);
+        f << "Max temperature: " << buf << " C\n";
+        f << "Thermal actions: " << r.thermal_actions << "\n";
+        snprintf(buf, sizeof(buf), "%.1f", r.thermal_pause_ms);
+        f << "Thermal pause: " << buf << " ms\n";
+    }
     snprintf(buf, sizeof(buf), "%.1f", r.wall_ms / 1000.0);
-    f << "Total wall time: " << buf << " s\n\n";
+    f << "Total wall time: " << buf << " s\n";
+    snprintf(buf, sizeof(buf), "%.1f", r.load_ms / 1000.0);
+    f << "Model load time: " << buf << " s\n\n";
+
+    if (!r.thermal_trace.empty()) {
+        f << "[THERMAL]\n";
+        for (const auto &ts : r.thermal_trace) {
+            f << strprintf("  +%.0f ms  %.1f C  threads %d  pace %.0f ms", ts.t_ms, ts.temp_c, ts.n_threads, ts.pace_ms);
+            if (!ts.action.empty()) f << "  (" << ts.action << ")";
+            f << "\n";
+        }
+        f << "\n";
+    }
 
     f << "[RESPONSE]\n";
     f << r.content << "\n\n";
@@ -230,44 +286,213 @@ static void save_log(const std::string &prompt, const std::vector<std::string> &
     f << "================================================================================\n";
 }
 
-static void print_stats(const RunResult &r) {
-    fprintf(stderr,
+// Sampler cost per generated token, where the greedy fast path shows
+static double sample_ms_per_token(const RunResult &r) {
+    return r.gen_tokens > 0 ? r.sample_ms / r.gen_tokens : 0.0;
+}
+
+static std::string format_stats(const RunResult &r) {
+    std::string images = strprintf("%d", r.images_processed);
+    if (!r.image_decode_ms.empty())
+        images += strprintf("  (decode %s ms, resize %s ms, waited %.0f ms, peak %.1f MB)",
+                            join_ms(r.image_decode_ms, ", ").c_str(), join_ms(r.image_resize_ms, ", ").c_str(),
+                            r.image_wait_ms, r.image_peak_bytes / (1024.0 * 1024.0));
+
+    std::string thermal;
+    if (!r.thermal_trace.empty())
+        thermal = strprintf("  thermal:        max %.1f C, %d governor action(s), %.0f ms paused\n",
+                            r.temp_max_c, r.thermal_actions, r.thermal_pause_ms);
+
+    std::string draft;
+    if (r.draft_tokens > 0)
+        draft = strprintf("  draft:          %d / %d accepted  (%.0f%%, %.1f ms drafting)\n",
+                          r.draft_accepted, r.draft_tokens, r.draft_acceptance * 100.0, r.draft_ms);
+
+    return strprintf(
         "\n--- stats -----------------------------------------------\n"
         "  model:          %s\n"
-        "  images:         %d\n"
-        "  prompt tokens:  %d  (%.1f ms, %.1f tok/s)\n"
-        "  gen tokens:     %d  (%.1f ms, %.1f tok/s)\n"
-        "  ttft:           %.0f ms\n"
+        "  images:         %s\n"
+        "  prompt tokens:  %d  (%.1f ms, %.1f tok/s, %d reused)\n"
+        "  gen tokens:     %d  (%.1f ms, %.1f tok/s, stop: %s)\n"
+        "%s"
+        "  ttft:           %.0f ms  (from request start)\n"
+        "  phases:         tokenize %.1f / encode %.1f / embd decode %.1f / prefill %.1f / sample %.1f / detok %.1f ms\n"
+        "  sampler:        %s  (%.3f ms/token)\n"
+        "  embd cache:     %d hit / %d miss  (saved %.0f ms)\n"
+        "  context:        %s  (%d tokens evicted)\n"
+        "  threads:        %d gen / %d batch / %d vision  (cpus %s)\n"
+        "  kv cache:       %s/%s  %.1f MB  (flash attn %s)\n"
+        "%s"
+        "  model load:     %.1f s\n"
         "  wall time:      %.1f s\n"
+        "  latency:        %.1f s  (model load + wall)\n"
         "---------------------------------------------------------\n",
         r.model_desc.c_str(),
-        r.images_processed,
+        images.c_str(),
         r.prompt_tokens, r.prompt_ms,
         (r.prompt_ms > 0.0) ? r.prompt_tokens / (r.prompt_ms / 1000.0) : 0.0,
-        r.gen_tokens, r.gen_ms, r.tokens_per_sec,
+        r.prompt_tokens_reused,
+        r.gen_tokens, r.gen_ms, r.tokens_per_sec, r.stop_reason.empty() ? "-" : r.stop_reason.c_str(),
+        draft.c_str(),
         r.ttft_ms,
-        r.wall_ms / 1000.0);
+        r.tokenize_ms, r.encode_ms, r.image_embd_ms, r.prefill_ms, r.sample_ms, r.detok_ms,
+        r.sampler.empty() ? "-" : r.sampler.c_str(), sample_ms_per_token(r),
+        r.embd_cache_hits, r.embd_cache_misses, r.embd_cache_saved_ms,
+        r.context_policy.c_str(), r.tokens_evicted,
+        r.n_threads, r.n_threads_batch, r.n_threads_vision, r.cpu_mask.empty() ? "all" : r.cpu_mask.c_str(),
+        r.kv_type_k.c_str(), r.kv_type_v.c_str(), r.kv_bytes / (1024.0 * 1024.0), r.flash_attn.c_str(),
+        thermal.c_str(),
+        r.load_ms / 1000.0,
+        r.wall_ms / 1000.0,
+        (r.load_ms + r.wall_ms) / 1000.0);
 }
 
-static void print_json_result(const RunResult &r) {
-    char tok_sec[32], wall_sec[32];
-    snprintf(tok_sec,  sizeof(tok_sec),  "%.1f", r.tokens_per_sec);
-    snprintf(wall_sec, sizeof(wall_sec), "%.1f", r.wall_ms / 1000.0);
+static std::string format_load_stats(const LoadTimings &t) {
+    return strprintf(
+        "\n--- startup ---------------------------------------------\n"
+        "  weights:        %s%s\n"
+        "  prefetch:       %.1f ms\n"
+        "  model load:     %.1f ms\n"
+        "  chat template:  %.1f ms\n"
+        "  context:        %.1f ms\n"
+        "  projector:      %.1f ms\n"
+        "  draft model:    %.1f ms\n"
+        "  warmup:         %.1f ms\n"
+        "  total:          %.1f ms\n"
+        "---------------------------------------------------------\n",
+        t.use_mmap ? "mmap" : "read", t.use_mlock ? " + mlock" : "",
+        t.prefetch_ms, t.model_ms, t.template_ms, t.context_ms, t.projector_ms, t.draft_ms, t.warmup_ms, t.total_ms);
+}
+
+static std::string format_memory_plan(const MemoryPlan &p) {
+    const double gb = 1024.0 * 1024.0 * 1024.0;
+    if (!p.error.empty())
+        return "\n  memory plan unavailable: " + p.error + "\n";
+    return strprintf(
+        "\n--- memory plan -----------------------------------------\n"
+        "  n_ctx:          %d  (batch %d, trained %d)\n"
+        "  weights:        %.2f GB\n"
+        "  projector:      %.2f GB\n"
+        "  draft model:    %.2f GB\n"
+        "  kv cache:       %.2f GB\n"
+        "  compute:        %.2f GB\n"
+        "  margin:         %.2f GB\n"
+        "  total:          %.2f GB  of %.2f GB available%s\n"
+        "---------------------------------------------------------\n",
+        p.n_ctx, p.n_batch, p.n_ctx_train,
+        p.weights_bytes / gb, p.projector_bytes / gb, p.draft_bytes / gb, p.kv_bytes / gb,
+        p.compute_bytes / gb, p.margin_bytes / gb, p.total_bytes / gb, p.available_bytes / gb,
+        p.available_bytes == 0 ? " (unknown)" : p.fits ? "" : "  [DOES NOT FIT]");
+}
+
+static std::string format_session_stats(const char *op, const SessionIO &io) {
+    const double mb = io.bytes / (1024.0 * 1024.0);
+    return strprintf(
+        "\n--- session %s ----------------------------------------\n"
+        "  kv tokens:      %d\n"
+        "  file size:      %.1f MB\n"
+        "  time:           %.1f ms  (%.0f MB/s)\n"
+        "---------------------------------------------------------\n",
+        op, io.n_tokens, mb, io.ms, io.ms > 0.0 ? mb / (io.ms / 1000.0) : 0.0);
+}
+
+static void print_stats(const RunResult &r) {
+    fputs(format_stats(r).c_str(), stderr);
+}
 
-    std::cout
+static std::string format_json_result(const RunResult &r) {
+    auto ms1 = [](double ms) { return strprintf("%.1f", ms); };
+    std::string thermal_trace;
+    for (const auto &ts : r.thermal_trace)
+        thermal_trace += strprintf("%s{\"t_ms\": %.0f, \"temp_c\": %.1f, \"n_threads\": %d, \"pace_ms\": %.0f, \"action\": \"%s\"}",
+                                   thermal_trace.empty() ? "" : ", ", ts.t_ms, ts.temp_c, ts.n_threads, ts.pace_ms,
+                                   json_escape(ts.action).c_str());
+    char tok_sec[32], wall_sec[32], load_sec[32], latency_sec[32];
+    snprintf(tok_sec,     sizeof(tok_sec),     "%.1f", r.tokens_per_sec);
+    snprintf(wall_sec,    sizeof(wall_sec),    "%.1f", r.wall_ms / 1000.0);
+    snprintf(load_sec,    sizeof(load_sec),    "%.1f", r.load_ms / 1000.0);
+    snprintf(latency_sec, sizeof(latency_sec), "%.1f", (r.load_ms + r.wall_ms) / 1000.0);
+    char draft_rate[32];
+    snprintf(draft_rate,  sizeof(draft_rate),  "%.2f", r.draft_acceptance);
+
+    std::ostringstream os;
+    os
         << "{\n"
         << "  \"content\": \""          << json_escape(r.content)    << "\",\n"
         << "  \"metadata\": {\n"
         << "    \"model\": \""          << json_escape(r.model_desc) << "\",\n"
         << "    \"images_processed\": " << r.images_processed        << ",\n"
+        << "    \"image_decode_ms\": ["  << join_ms(r.image_decode_ms, ", ") << "],\n"
+        << "    \"image_resize_ms\": ["  << join_ms(r.image_resize_ms, ", ") << "],\n"
+        << "    \"image_peak_mb\": "    << ms1(r.image_peak_bytes / (1024.0 * 1024.0)) << ",\n"
+        << "    \"image_wait_ms\": "    << static_cast<int>(r.image_wait_ms) << ",\n"
         << "    \"prompt_tokens\": "    << r.prompt_tokens           << ",\n"
+        << "    \"prompt_tokens_reused\": " << r.prompt_tokens_reused  << ",\n"
         << "    \"gen_tokens\": "       << r.gen_tokens              << ",\n"
+        << "    \"stop_reason\": \""   << r.stop_reason             << "\",\n"
         << "    \"total_tokens\": "     << r.total_tokens            << ",\n"
         << "    \"tokens_per_sec\": "   << tok_sec                   << ",\n"
+        << "    \"draft_tokens\": "     << r.draft_tokens            << ",\n"
+        << "    \"draft_accepted\": "   << r.draft_accepted          << ",\n"
+        << "    \"draft_acceptance\": " << draft_rate                << ",\n"
+        << "    \"draft_ms\": "         << static_cast<int>(r.draft_ms) << ",\n"
         << "    \"ttft_ms\": "          << static_cast<int>(r.ttft_ms) << ",\n"
-        << "    \"wall_time_sec\": "    << wall_sec                  << "\n"
+        << "    \"tokenize_ms\": "      << ms1(r.tokenize_ms)        << ",\n"
+        << "    \"encode_ms\": "        << ms1(r.encode_ms)          << ",\n"
+        << "    \"image_embd_ms\": "    << ms1(r.image_embd_ms)      << ",\n"
+        << "    \"prefill_ms\": "       << ms1(r.prefill_ms)         << ",\n"
+        << "    \"sample_ms\": "        << ms1(r.sample_ms)          << ",\n"
+        << "    \"sample_ms_per_token\": " << strprintf("%.3f", sample_ms_per_token(r)) << ",\n"
+        << "    \"sampler\": \""        << json_escape(r.sampler)    << "\",\n"
+        << "    \"detok_ms\": "         << ms1(r.detok_ms)           << ",\n"
+        << "    \"embd_cache_hits\": "  << r.embd_cache_hits         << ",\n"
+        << "    \"embd_cache_misses\": " << r.embd_cache_misses      << ",\n"
+        << "    \"embd_cache_saved_ms\": " << static_cast<int>(r.embd_cache_saved_ms) << ",\n"
+        << "    \"context_policy\": \"" << json_escape(r.context_policy) << "\",\n"
+        << "    \"tokens_evicted\": "   << r.tokens_evicted          << ",\n"
+        << "    \"n_threads\": "        << r.n_threads               << ",\n"
+        << "    \"n_threads_batch\": "  << r.n_threads_batch         << ",\n"
+        << "    \"n_threads_vision\": " << r.n_threads_vision        << ",\n"
+        << "    \"cpu_mask\": \""       << json_escape(r.cpu_mask)   << "\",\n"
+        << "    \"kv_type_k\": \""      << json_escape(r.kv_type_k)  << "\",\n"
+        << "    \"kv_type_v\": \""      << json_escape(r.kv_type_v)  << "\",\n"
+        << "    \"flash_attn\": \""     << json_escape(r.flash_attn) << "\",\n"
+        << "    \"kv_cache_mb\": "      << ms1(r.kv_bytes / (1024.0 * 1024.0)) << ",\n"
+        << "    \"temp_max_c\": "       << ms1(r.temp_max_c)         << ",\n"
+        << "    \"thermal_actions\": "  << r.thermal_actions         << ",\n"
+        << "    \"thermal_pause_ms\": " << static_cast<int>(r.thermal_pause_ms) << ",\n"
+        << "    \"thermal_trace\": ["   << thermal_trace             << "],\n"
+        << "    \"wall_time_sec\": "    << wall_sec                  << ",\n"
+        << "    \"load_time_sec\": "    << load_sec                  << ",\n"
+        << "    \"latency_sec\": "      << latency_sec               << "\n"
         << "  }\n"
         << "}\n";
+    return os.str();
+}
+
+// Pretty JSON from format_json_result() on one line. Strings are escaped, so
+// every raw newline is layout and is followed only by indentation.
+static std::string compact_json(const std::string &pretty) {
+    std::string out;
+    out.reserve(pretty.size());
+    for (size_t i = 0; i < pretty.size(); ++i) {
+        if (pretty[i] != '\n') {
+            out += pretty[i];
+            continue;
+        }
+        while (i + 1 < pretty.size() && pretty[i + 1] == ' ') ++i;
+    }
+    return out;
+}
+
+// --json-stream records: one "token" line per piece, then one "result" line
+static std::string format_token_event(const TokenEvent &ev) {
+    return strprintf("{\"type\":\"token\",\"index\":%d,\"token\":%d,\"text\":\"%s\",\"t_ms\":%.2f,\"dt_ms\":%.2f}\n",
+                     ev.index, ev.token, json_escape(ev.piece).c_str(), ev.t_ms, ev.dt_ms);
+}
+
+static std::string format_stream_result(const RunResult &r) {
+    return "{\"type\":\"result\"," + compact_json(format_json_result(r)).substr(1) + "\n";
 }
 
 static int check_health() {
@@ -353,7 +578,13 @@ static int check_health() {
     }
 
     std::cout << "\nModel Status:\n";
-    Config cfg = load_config();
+    Config cfg;
+    try {
+        cfg = load_config();
+    } catch (const std::exception &e) {
+        std::cout << "  " << e.what() << " [INVALID]\n";
+        all_ok = false;
+    }
     if (!cfg.source.empty())
         std::cout << "  Config loaded: " << cfg.source << "\n";
     if (!cfg.model_path.empty()) {
@@ -367,6 +598,36 @@ static int check_health() {
         }
     }
 
+    if (!cfg.model_path.empty() && fs::exists(cfg.model_path)) {
+        std::cout << "\nMemory Plan:\n";
+        PiVisionConfig pc;
+        apply_config(pc, cfg.doc);
+        pc.model_path = cfg.model_path;
+        pc.vision_path = cfg.vision_path;
+
+        const double gb = 1024.0 * 1024.0 * 1024.0;
+        MemoryPlan plan = PiVision::plan_memory(pc);
+        if (!plan.error.empty()) {
+            std::cout << "  " << plan.error << "\n";
+        } else {
+            std::cout << strprintf("  Estimate at n_ctx %d: %.2f GB (weights %.2f, projector %.2f, KV %.2f, compute %.2f)",
+                                   plan.n_ctx, plan.total_bytes / gb, plan.weights_bytes / gb,
+                                   plan.projector_bytes / gb, plan.kv_bytes / gb, plan.compute_bytes / gb);
+            if (!plan.fits) {
+                std::cout << " [WARNING: exceeds available memory]\n";
+                all_ok = false;
+            } else {
+                std::cout << " [OK]\n";
+            }
+            pc.auto_n_ctx = true;
+            MemoryPlan best = PiVision::plan_memory(pc);
+            if (best.fits)
+                std::cout << "  Largest n_ctx that fits: " << best.n_ctx << " (trained " << best.n_ctx_train << ")\n";
+            else
+                std::cout << "  Model does not fit at any n_ctx\n";
+        }
+    }
+
     std::cout << "\n";
     if (all_ok) {
         std::cout << "Status: All checks passed!\n";
@@ -376,13 +637,838 @@ static int check_health() {
     return 1;
 }
 
-int main(int argc, char *argv[]) {
-    std::string model, vision, prompt, config_path;
+// ---------- Single-shot requests (local, daemon and client modes) ----------
+
+using Sink = std::function<void(const std::string &)>;
+
+struct ShotRequest {
+    std::string prompt;
     std::vector<std::string> images;
+    std::vector<std::string> image_data;  // encoded bytes of images[i] read from stdin or a FIFO; else empty
+    GenerationParams gen;
+    std::string log_directory;
+    std::string model;       // daemon model by name; empty = its default
+    bool json_mode = false;
+    bool stream    = false;  // forward pieces as they are generated; with json_mode, as NDJSON
+    bool verbose   = false;
+    bool resident  = false;  // model was already loaded when the request arrived
+};
+
+// "-" (stdin) and FIFOs can be read only once, so their bytes are read up
+// front and passed to the library as an encoded buffer instead of a path
+static bool is_stream_image(const std::string &path) {
+    struct stat st;
+    return path == "-" || (stat(path.c_str(), &st) == 0 && S_ISFIFO(st.st_mode));
+}
+
+static bool read_stream_image(const std::string &path, std::string &out) {
+    std::ifstream f;
+    std::istream *in = &std::cin;
+    if (path != "-") {
+        f.open(path, std::ios::binary);
+        if (!f) return false;
+        in = &f;
+    }
+    out.assign(std::istreambuf_iterator<char>(*in), std::istreambuf_iterator<char>());
+    return !out.empty();
+}
+
+static bool has_image_data(const ShotRequest &req, size_t i) {
+    return i < req.image_data.size() && !req.image_data[i].empty();
+}
+
+// Runs one prompt against an already-loaded model. Normal output goes to `out`,
+// diagnostics and stats to `err`. Returns the process exit status.
+static int run_single_shot(PiVision &pv, const ShotRequest &req, const Sink &out, const Sink &err) {
+    auto fail = [&](const std::string &msg, const std::string &prefix) {
+        if (req.json_mode) out("{\"error\":\"" + json_escape(msg) + "\"}\n");
+        else err(prefix + msg + "\n");
+        return 1;
+    };
+
+    if (!req.images.empty()) {
+        std::vector<std::string> files;
+        for (size_t idx = 0; idx < req.images.size(); ++idx)
+            if (!has_image_data(req, idx)) files.push_back(req.images[idx]);
+        std::string e = pv.validate(files);
+        if (!e.empty())
+            return fail(e, "error: ");
+        // Decodes run in parallel and overlap with prompt formatting; run() waits for them
+        for (size_t idx = 0; idx < req.images.size(); ++idx) {
+            const auto &img = req.images[idx];
+            if (has_image_data(req, idx)) {
+                const std::string &data = req.image_data[idx];
+                if (!pv.load_image_buffer(reinterpret_cast<const uint8_t *>(data.data()), data.size())) {
+                    pv.clear_images();
+                    return fail("not a JPEG or PNG image: " + img, "error: ");
+                }
+            } else {
+                pv.load_image_async(img);
+            }
+            if (req.verbose)
+                err("Image " + std::to_string(idx + 1) + ": " + img + "\n");
+        }
+    }
+
+    RunResult result;
+    if (req.stream && req.json_mode) {
+        result = pv.run_events(req.prompt, [&](const TokenEvent &ev) { out(format_token_event(ev)); }, req.gen);
+        out(format_stream_result(result));
+    } else if (req.stream) {
+        result = pv.run(req.prompt, out, req.gen);
+        out("\n");
+    } else {
+        result = pv.run_collect(req.prompt, req.gen);
+        if (req.json_mode)
+            out(format_json_result(result));
+        else
+            out(result.content + "\n");
+    }
+
+    // A resident daemon paid the model load before this request arrived
+    if (req.resident)
+        result.load_ms = 0.0;
+
+    if (req.verbose) err(format_stats(result));
+    save_log(req.prompt, req.images, result, req.log_directory);
+    return 0;
+}
+
+static std::string read_prompt(const std::string &prompt) {
+    if (!fs::is_regular_file(prompt)) return prompt;
+    std::ifstream pf(prompt);
+    return std::string(std::istreambuf_iterator<char>(pf), std::istreambuf_iterator<char>());
+}
+
+// Pins each prompt file's text as a shared prefix, named after the file
+static void pin_prefixes(PiVision &pv, const std::vector<std::string> &files, bool verbose) {
+    for (const auto &file : files) {
+        std::string name = fs::path(file).filename().string();
+        if (!pv.pin_prefix(name, read_prompt(file)))
+            std::cerr << "warning: could not pin prefix " << file << "\n";
+        else if (verbose)
+            std::cerr << "pinned prefix: " << name << "\n";
+    }
+}
+
+// ---------- Daemon wire format ----------
+// Every message is "<tag> <len>\n" followed by <len> payload bytes.
+// Client -> daemon: prompt, image (path) / image_data (encoded bytes; repeatable, in
+//                   order), model (name), json, stream, verbose, log_directory,
+//                   max_tokens, max_wall_ms, stop (repeatable), grammar, json_schema, end.
+// Generation settings the client does not send keep the daemon's defaults.
+// Daemon -> client: out (stdout bytes), err (stderr bytes), done (exit status).
+
+static bool write_all(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += w;
+        n -= static_cast<size_t>(w);
+    }
+    return true;
+}
+
+static bool send_frame(int fd, const std::string &tag, const std::string &payload) {
+    std::string msg = tag + " " + std::to_string(payload.size()) + "\n" + payload;
+    return write_all(fd, msg.data(), msg.size());
+}
+
+struct FrameReader {
+    int fd;
+    std::string buf;
+
+    bool fill() {
+        char chunk[4096];
+        while (true) {
+            ssize_t r = read(fd, chunk, sizeof(chunk));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) return false;
+            buf.append(chunk, static_cast<size_t>(r));
+            return true;
+        }
+    }
+
+    bool next(std::string &tag, std::string &payload) {
+        size_t nl;
+        while ((nl = buf.find('\n')) == std::string::npos)
+            if (!fill()) return false;
+
+        std::string header = buf.substr(0, nl);
+        size_t sp = header.find(' ');
+        if (sp == std::string::npos) return false;
+        tag = header.substr(0, sp);
+        size_t len = std::strtoul(header.c_str() + sp + 1, nullptr, 10);
+        buf.erase(0, nl + 1);
+
+        while (buf.size() < len)
+            if (!fill()) return false;
+        payload = buf.substr(0, len);
+        buf.erase(0, len);
+        return true;
+    }
+};
+
+static bool make_socket_addr(const std::string &path, sockaddr_un &addr) {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+static int connect_socket(const std::string &path) {
+    sockaddr_un addr;
+    if (!make_socket_addr(path, addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static volatile sig_atomic_t g_stop_serving = 0;
+
+static void on_serve_signal(int) {
+    g_stop_serving = 1;
+}
+
+static std::string join_names(const std::vector<std::string> &names) {
+    std::string out;
+    for (const auto &n : names)
+        out += (out.empty() ? "" : ", ") + n;
+    return out;
+}
+
+// The pool's model for a request, loading it if needed. Pinned prefixes live
+// in an instance's KV cache, so they are pinned again after every load.
+static PiVision &acquire_model(PiVisionPool &pool, const std::string &name, const std::vector<std::string> &pin_files,
+                               bool verbose, bool &loaded) {
+    if (!pool.has(name))
+        throw std::runtime_error("unknown model: " + name + " (available: " + join_names(pool.names()) + ")");
+    loaded = !pool.resident(name);
+    PiVision &pv = pool.get(name);
+    if (loaded) {
+        if (verbose) {
+            fputs(format_memory_plan(pv.memory_plan()).c_str(), stderr);
+            fputs(format_load_stats(pv.load_timings()).c_str(), stderr);
+        }
+        pin_prefixes(pv, pin_files, verbose);
+    }
+    return pv;
+}
+
+static void serve_client(int fd, PiVisionPool &pool, const std::string &default_model, const GenerationParams &gen,
+                         const std::vector<std::string> &pin_files, bool verbose, int request_no) {
+    namespace chr = std::chrono;
+
+    FrameReader rd{fd, {}};
+    ShotRequest req;
+    req.gen = gen;
+    req.resident = true;
+
+    std::string tag, payload;
+    bool complete = false, client_stop = false;
+    while (rd.next(tag, payload)) {
+        if (tag == "end") { complete = true; break; }
+        if      (tag == "prompt")        req.prompt = payload;
+        else if (tag == "image")         req.images.push_back(payload);
+        else if (tag == "image_data") {
+            req.image_data.resize(req.images.size());
+            req.images.push_back("<stdin>");
+            req.image_data.push_back(payload);
+        }
+        else if (tag == "log_directory") req.log_directory = payload;
+        else if (tag == "model")         req.model = payload;
+        else if (tag == "json")          req.json_mode = payload == "1";
+        else if (tag == "stream")        req.stream = payload == "1";
+        else if (tag == "verbose")       req.verbose = payload == "1";
+        else if (tag == "max_tokens")    req.gen.max_tokens = std::atoi(payload.c_str());
+        else if (tag == "max_wall_ms")   req.gen.max_wall_ms = std::atoi(payload.c_str());
+        else if (tag == "grammar") {
+            req.gen.grammar = payload;
+            req.gen.json_schema.clear();
+        } else if (tag == "json_schema") {
+            req.gen.json_schema = payload;
+            req.gen.grammar.clear();
+        } else if (tag == "stop") {
+            // The client's stop strings replace the daemon's
+            if (!client_stop) req.gen.stop.clear();
+            client_stop = true;
+            req.gen.stop.push_back(payload);
+        }
+    }
+    if (!complete) {
+        fprintf(stderr, "[serve] request %d: client closed or timed out before \"end\", dropped\n", request_no);
+        return;
+    }
+
+    if (req.log_directory.empty())
+        req.log_directory = g_log_directory;
+    if (req.model.empty())
+        req.model = default_model;
+
+    auto t0 = chr::steady_clock::now();
+    int status = 1;
+    PiVision *pv = nullptr;
+    try {
+        bool loaded = false;
+        pv = &acquire_model(pool, req.model, pin_files, verbose, loaded);
+        // A model loaded for this request charges it the load time
+        req.resident = !loaded;
+        // A client that went away cancels the rest of its generation
+        status = run_single_shot(*pv, req,
+            [fd, pv](const std::string &s) { if (!send_frame(fd, "out", s)) pv->cancel(); },
+            [fd, pv](const std::string &s) { if (!send_frame(fd, "err", s)) pv->cancel(); });
+    } catch (const std::exception &e) {
+        if (pv) pv->clear_images();
+        if (req.json_mode) send_frame(fd, "out", "{\"error\":\"" + json_escape(e.what()) + "\"}\n");
+        else               send_frame(fd, "err", std::string("error: ") + e.what() + "\n");
+    }
+    double ms = chr::duration<double, std::milli>(chr::steady_clock::now() - t0).count();
+
+    send_frame(fd, "done", std::to_string(status));
+    fprintf(stderr, "[serve] request %d: model %s, %zu image(s), %.1f ms, status %d\n",
+            request_no, req.model.c_str(), req.images.size(), ms, status);
+}
+
+static void print_pool_event(const PoolEvent &ev) {
+    fprintf(stderr, "[pool] %s %s: %.1f ms, %.2f GB, %.2f GB resident\n", ev.type.c_str(), ev.name.c_str(), ev.ms,
+            ev.bytes / (1024.0 * 1024.0 * 1024.0), ev.resident_bytes / (1024.0 * 1024.0 * 1024.0));
+}
+
+// Serves requests with the pool's models; default_model answers requests that
+// do not name one and is loaded before the socket opens
+static int serve(PiVisionPool &pool, const std::string &default_model, const std::string &socket_path,
+                 const GenerationParams &gen, const std::vector<std::string> &pin_files, bool verbose) {
+    bool loaded = false;
+    acquire_model(pool, default_model, pin_files, verbose, loaded);
+
+    sockaddr_un addr;
+    if (!make_socket_addr(socket_path, addr)) {
+        std::cerr << "error: socket path too long: " << socket_path << "\n";
+        return 1;
+    }
+
+    // Refuse to steal the socket from a live daemon; clear a stale one
+    if (fs::exists(socket_path)) {
+        int probe = connect_socket(socket_path);
+        if (probe >= 0) {
+            close(probe);
+            std::cerr << "error: a daemon is already listening on " << socket_path << "\n";
+            return 1;
+        }
+        unlink(socket_path.c_str());
+    }
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd < 0 || bind(lfd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(lfd, 8) != 0) {
+        std::cerr << "error: cannot listen on " << socket_path << ": " << std::strerror(errno) << "\n";
+        if (lfd >= 0) close(lfd);
+        return 1;
+    }
+    chmod(socket_path.c_str(), 0600);
+
+    // No SA_RESTART so accept() returns on SIGINT/SIGTERM
+    struct sigaction sa {};
+    sa.sa_handler = on_serve_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::cerr << "pivision daemon listening on " << socket_path << "\n";
+
+    int n_served = 0;
+    while (!g_stop_serving) {
+        int cfd = accept(lfd, nullptr, nullptr);
+        if (cfd < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "error: accept failed: " << std::strerror(errno) << "\n";
+            break;
+        }
+        timeval tv {};
+        tv.tv_sec = CLIENT_TIMEOUT_S;
+        setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        serve_client(cfd, pool, default_model, gen, pin_files, verbose, ++n_served);
+        close(cfd);
+    }
+
+    close(lfd);
+    unlink(socket_path.c_str());
+    std::cerr << "pivision daemon stopped after " << n_served << " request(s)\n";
+    return 0;
+}
+
+// ---------- Watch mode ----------
+
+struct WatchFrame {
+    std::string path;
+    std::chrono::system_clock::time_point arrived;  // file mtime: when the frame was completed
+};
+
+static bool is_image_name(const std::string &name) {
+    std::string ext = fs::path(name).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+    return ext == ".jpg" || ext == ".jpeg" || ext == ".png";
+}
+
+// Moves pending inotify events into `queue`, waiting up to wait_ms (-1 =
+// until there is one). Only the newest max_queue frames are kept; older ones
+// are dropped and counted. Returns false on an unexpected poll error.
+static bool drain_watch_events(int fd, const std::string &dir, std::deque<WatchFrame> &queue, size_t max_queue,
+                               int wait_ms, int &dropped) {
+    pollfd pfd = {fd, POLLIN, 0};
+    int n = poll(&pfd, 1, wait_ms);
+    if (n < 0) return errno == EINTR;
+
+    alignas(inotify_event) char buf[16384];
+    ssize_t len;
+    while (n > 0 && (len = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len;) {
+            const auto *ev = reinterpret_cast<const inotify_event *>(p);
+            p += sizeof(inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW)
+                fprintf(stderr, "[watch] inotify queue overflowed, some frames were missed\n");
+            if (ev->len == 0 || !is_image_name(ev->name))
+                continue;
+
+            WatchFrame frame;
+            frame.path = (fs::path(dir) / ev->name).string();
+            frame.arrived = std::chrono::system_clock::now();
+            struct stat st;
+            if (stat(frame.path.c_str(), &st) == 0)
+                frame.arrived = std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                    std::chrono::seconds(st.st_mtim.tv_sec) + std::chrono::nanoseconds(st.st_mtim.tv_nsec)));
+            queue.push_back(std::move(frame));
+            if (queue.size() > max_queue) {
+                queue.pop_front();
+                ++dropped;
+            }
+        }
+    }
+    return true;
+}
+
+// Writes via a temporary file so readers of out_path never see a partial result
+static bool write_file_atomic(const std::string &out_path, const std::string &text) {
+    const std::string tmp = out_path + ".tmp";
+    {
+        std::ofstream f(tmp);
+        if (!(f << text)) return false;
+    }
+    return std::rename(tmp.c_str(), out_path.c_str()) == 0;
+}
+
+// Runs `base` on every JPG/PNG completed in `dir` (closed after writing or
+// moved in) until SIGINT/SIGTERM. Each result is written as <image>.json to
+// out_dir, or next to the image when out_dir is empty.
+static int run_watch(PiVision &pv, const std::string &dir, const ShotRequest &base, const std::string &out_dir,
+                     int max_queue) {
+    namespace chr = std::chrono;
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        std::cerr << "error: cannot watch " << dir << ": " << std::strerror(errno) << "\n";
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    // No SA_RESTART so poll() returns on SIGINT/SIGTERM
+    struct sigaction sa {};
+    sa.sa_handler = on_serve_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    std::cerr << "pivision watching " << dir << " (queue " << max_queue << ")\n";
+
+    std::deque<WatchFrame> queue;
+    int dropped = 0, n_done = 0, n_failed = 0;
+    double latency_sum = 0.0;
+    const auto start = chr::steady_clock::now();
+    while (!g_stop_serving) {
+        if (!drain_watch_events(fd, dir, queue, static_cast<size_t>(max_queue), queue.empty() ? -1 : 0, dropped)) {
+            std::cerr << "error: watching " << dir << " failed: " << std::strerror(errno) << "\n";
+            break;
+        }
+        if (queue.empty()) continue;
+
+        WatchFrame frame = std::move(queue.front());
+        queue.pop_front();
+        ShotRequest req = base;
+        req.images = {frame.path};
+        req.json_mode = true;
+
+        std::string result, diag;
+        int status = 1;
+        try {
+            status = run_single_shot(pv, req,
+                [&result](const std::string &s) { result += s; },
+                [&diag](const std::string &s) { diag += s; });
+        } catch (const std::exception &e) {
+            pv.clear_images();
+            result = "{\"error\":\"" + json_escape(e.what()) + "\"}\n";
+        }
+
+        const fs::path image(frame.path);
+        const fs::path out = (out_dir.empty() ? image.parent_path() : fs::path(out_dir)) / (image.filename().string() + ".json");
+        if (!write_file_atomic(out.string(), result))
+            std::cerr << "error: cannot write " << out.string() << "\n";
+
+        // From the frame's completion on disk, so time spent queued counts
+        const double latency_s = chr::duration<double>(chr::system_clock::now() - frame.arrived).count();
+        const double minutes = chr::duration<double>(chr::steady_clock::now() - start).count() / 60.0;
+        ++n_done;
+        if (status != 0) ++n_failed;
+        latency_sum += latency_s;
+        fputs(diag.c_str(), stderr);
+        fprintf(stderr, "[watch] %s: %s, latency %.2f s, queue %zu, dropped %d, %.1f frames/min\n",
+                image.filename().string().c_str(), status == 0 ? "ok" : "failed", latency_s, queue.size(), dropped,
+                minutes > 0.0 ? n_done / minutes : 0.0);
+    }
+
+    close(fd);
+    const double minutes = chr::duration<double>(chr::steady_clock::now() - start).count() / 60.0;
+    fprintf(stderr, "pivision watch stopped: %d frame(s), %d failed, %d dropped, mean latency %.2f s, %.1f frames/min\n",
+            n_done, n_failed, dropped, n_done > 0 ? latency_sum / n_done : 0.0, minutes > 0.0 ? n_done / minutes : 0.0);
+    return 0;
+}
+
+static int run_client(const std::string &socket_path, const ShotRequest &req) {
+    namespace chr = std::chrono;
+    auto t0 = chr::steady_clock::now();
+
+    int fd = connect_socket(socket_path);
+    if (fd < 0) {
+        std::string msg = "cannot connect to pivision daemon at " + socket_path + " – is `pivision --serve` running?";
+        if (req.json_mode) print_json_error(msg);
+        else std::cerr << "error: " << msg << "\n";
+        return 1;
+    }
+
+    bool ok = send_frame(fd, "prompt", req.prompt);
+    for (size_t i = 0; i < req.images.size(); ++i)
+        ok = ok && (has_image_data(req, i) ? send_frame(fd, "image_data", req.image_data[i])
+                                           : send_frame(fd, "image", req.images[i]));
+    if (!req.model.empty())
+        ok = ok && send_frame(fd, "model", req.model);
+    if (req.gen.max_tokens > 0)
+        ok = ok && send_frame(fd, "max_tokens", std::to_string(req.gen.max_tokens));
+    if (req.gen.max_wall_ms > 0)
+        ok = ok && send_frame(fd, "max_wall_ms", std::to_string(req.gen.max_wall_ms));
+    for (const auto &stop : req.gen.stop)
+        ok = ok && send_frame(fd, "stop", stop);
+    if (!req.gen.grammar.empty())
+        ok = ok && send_frame(fd, "grammar", req.gen.grammar);
+    if (!req.gen.json_schema.empty())
+        ok = ok && send_frame(fd, "json_schema", req.gen.json_schema);
+    ok = ok && send_frame(fd, "log_directory", req.log_directory)
+            && send_frame(fd, "json", req.json_mode ? "1" : "0")
+            && send_frame(fd, "stream", req.stream ? "1" : "0")
+            && send_frame(fd, "verbose", req.verbose ? "1" : "0")
+            && send_frame(fd, "end", "");
+
+    int status = 1;
+    bool done = false;
+    FrameReader rd{fd, {}};
+    std::string tag, payload;
+    while (ok && rd.next(tag, payload)) {
+        if (tag == "out") {
+            std::cout << payload << std::flush;
+        } else if (tag == "err") {
+            std::cerr << payload;
+        } else if (tag == "done") {
+            status = std::atoi(payload.c_str());
+            done = true;
+            break;
+        }
+    }
+    close(fd);
+
+    if (!done) {
+        std::cerr << "error: daemon closed the connection before finishing the request\n";
+        return 1;
+    }
+
+    if (req.verbose) {
+        double ms = chr::duration<double, std::milli>(chr::steady_clock::now() - t0).count();
+        fprintf(stderr, "  daemon latency: %.1f ms (model resident, socket %s)\n", ms, socket_path.c_str());
+    }
+    return status;
+}
+
+// ---------- Batch mode ----------
+
+// A manifest is either a directory of *.json configs or a text file listing
+// one config path per line (blank lines and # comments are skipped).
+static std::vector<std::string> read_manifest(const std::string &manifest) {
+    std::vector<std::string> configs;
+
+    if (fs::is_directory(manifest)) {
+        for (const auto &entry : fs::directory_iterator(manifest))
+            if (entry.is_regular_file() && entry.path().extension() == ".json")
+                configs.push_back(entry.path().string());
+        std::sort(configs.begin(), configs.end());
+        return configs;
+    }
+
+    std::ifstream f(manifest);
+    std::string line;
+    while (std::getline(f, line)) {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#') continue;
+        size_t end = line.find_last_not_of(" \t\r");
+        configs.push_back(line.substr(start, end - start + 1));
+    }
+    return configs;
+}
+
+// Layers PiVisionConfig defaults < config file < command line
+static PiVisionConfig make_config(const Config &file_cfg, const nlohmann::json &cli, bool verbose) {
+    PiVisionConfig cfg;
+    cfg.n_parallel = 1;  // cases run one after another unless --parallel says otherwise
+    apply_config(cfg, file_cfg.doc);
+    try {
+        apply_config(cfg, cli);
+    } catch (const std::exception &e) {
+        throw std::runtime_error(std::string("command line: ") + e.what());
+    }
+    cfg.verbose = verbose;
+
+    // Concurrent cases share the KV cache, so each of them gets a full context
+    cfg.n_ctx *= cfg.n_parallel;
+    return cfg;
+}
+
+// Generation limits for every request, layered like make_config()
+static GenerationParams make_generation(const Config &file_cfg, const nlohmann::json &cli) {
+    GenerationParams gen;
+    apply_generation(gen, file_cfg.doc);
+    try {
+        apply_generation(gen, cli);
+    } catch (const std::exception &e) {
+        throw std::runtime_error(std::string("command line: ") + e.what());
+    }
+    return gen;
+}
+
+// Runs one model group's cases through PiVision::run_batch so their decodes
+// are batched together; prints each case as run_single_shot would. Returns
+// the number of failed cases.
+static int run_cases_parallel(PiVision &pv, const std::vector<ShotRequest> &reqs,
+                              const std::vector<const Config *> &sources, const Sink &out, const Sink &err) {
+    // Cases with invalid images fail up front; the rest go in one batch
+    std::vector<std::string> errors(reqs.size());
+    std::vector<size_t> slot(reqs.size(), 0);
+    std::vector<BatchRequest> batch;
+    for (size_t i = 0; i < reqs.size(); ++i) {
+        if (!reqs[i].images.empty())
+            errors[i] = pv.validate(reqs[i].images);
+        if (!errors[i].empty()) continue;
+        slot[i] = batch.size();
+        BatchRequest r;
+        r.prompt = reqs[i].prompt;
+        r.image_paths = reqs[i].images;
+        r.gen = reqs[i].gen;
+        batch.push_back(std::move(r));
+    }
+
+    BatchResult br = pv.run_batch(batch);
+
+    int n_failed = 0;
+    bool load_charged = false;
+    for (size_t i = 0; i < reqs.size(); ++i) {
+        const ShotRequest &req = reqs[i];
+        err("-- case: " + sources[i]->source + "\n");
+        if (errors[i].empty() && !br.results[slot[i]].error.empty())
+            errors[i] = br.results[slot[i]].error;
+        if (!errors[i].empty()) {
+            if (req.json_mode) out("{\"error\":\"" + json_escape(errors[i]) + "\"}\n");
+            else err("error: " + errors[i] + "\n");
+            ++n_failed;
+            continue;
+        }
+        RunResult &r = br.results[slot[i]];
+        // As in sequential runs, only the first case pays the model load
+        r.load_ms = load_charged ? 0.0 : br.load_ms;
+        load_charged = true;
+        out(req.json_mode ? format_json_result(r) : r.content + "\n");
+        if (req.verbose) err(format_stats(r));
+        save_log(req.prompt, req.images, r, req.log_directory);
+    }
+
+    err(strprintf("parallel: %zu case(s), peak %d in flight, %d gen tokens in %.1f s (%.1f tok/s aggregate)\n",
+                  reqs.size(), br.peak_parallel, br.gen_tokens, br.wall_ms / 1000.0, br.tokens_per_sec));
+    return n_failed;
+}
+
+// Runs every config in the manifest, loading each model/projector pair once.
+// With n_parallel > 1 the cases of a model run concurrently via PiVision::run_batch.
+// Each model is configured from its group's first config, overridden by `cli`.
+static int run_batch(const std::string &manifest, const nlohmann::json &cli, bool json_mode, bool verbose,
+                     const std::vector<std::string> &pin_files) {
+    namespace chr = std::chrono;
+    auto batch_start = chr::steady_clock::now();
+
+    if (!fs::exists(manifest)) {
+        std::cerr << "error: batch manifest not found: " << manifest << "\n";
+        return 1;
+    }
+
+    std::vector<Config> cases;
+    size_t n_invalid = 0;
+    for (const auto &path : read_manifest(manifest)) {
+        if (!fs::exists(path)) {
+            std::cerr << "warning: config file not found: " << path << "\n";
+            continue;
+        }
+        try {
+            cases.push_back(parse_config_file(path));
+        } catch (const std::exception &e) {
+            std::cerr << "error: " << e.what() << "\n";
+            ++n_invalid;
+        }
+    }
+    if (cases.empty()) {
+        std::cerr << "error: no configs in batch manifest: " << manifest << "\n";
+        return 1;
+    }
+
+    // Group by model pair, keeping manifest order within and across groups
+    std::vector<std::vector<const Config *>> groups;
+    for (const auto &c : cases) {
+        auto it = std::find_if(groups.begin(), groups.end(), [&](const std::vector<const Config *> &g) {
+            return g.front()->model_path == c.model_path && g.front()->vision_path == c.vision_path;
+        });
+        if (it == groups.end()) groups.push_back({&c});
+        else it->push_back(&c);
+    }
+
+    auto out = [](const std::string &s) { std::cout << s << std::flush; };
+    auto err = [](const std::string &s) { std::cerr << s; };
+
+    int n_failed = static_cast<int>(n_invalid);
+    int n_loads = 0;
+    for (const auto &group : groups) {
+        const Config &first = *group.front();
+        std::cerr << "== model: " << first.model_path << " (" << group.size() << " case(s)) ==\n";
+
+        std::unique_ptr<PiVision> pv;
+        int n_parallel = 1;
+        try {
+            PiVisionConfig cfg = make_config(first, cli, verbose);
+            cfg.model_path = first.model_path;
+            cfg.vision_path = first.vision_path;
+            n_parallel = cfg.n_parallel;
+            pv = std::make_unique<PiVision>(cfg);
+            ++n_loads;
+            if (verbose) {
+                fputs(format_memory_plan(pv->memory_plan()).c_str(), stderr);
+                fputs(format_load_stats(pv->load_timings()).c_str(), stderr);
+            }
+            pin_prefixes(*pv, pin_files, verbose);
+        } catch (const std::exception &e) {
+            std::cerr << "error: " << e.what() << "\n";
+            n_failed += static_cast<int>(group.size());
+            continue;
+        }
+
+        std::vector<ShotRequest> reqs;
+        std::vector<const Config *> sources;
+        for (size_t i = 0; i < group.size(); ++i) {
+            const Config &c = *group[i];
+
+            ShotRequest req;
+            req.prompt = read_prompt(c.prompt);
+            if (!c.default_image_path.empty())
+                req.images.push_back(c.default_image_path);
+            req.gen = make_generation(c, cli);
+            req.log_directory = c.log_directory;
+            req.json_mode = json_mode;
+            req.verbose = verbose;
+            req.resident = i > 0;  // only the first case pays the model load
+
+            if (req.prompt.empty()) {
+                std::cerr << "error: no prompt in " << c.source << "\n";
+                ++n_failed;
+                continue;
+            }
+            reqs.push_back(req);
+            sources.push_back(&c);
+        }
+
+        if (n_parallel > 1) {
+            n_failed += run_cases_parallel(*pv, reqs, sources, out, err);
+            continue;
+        }
+
+        for (size_t i = 0; i < reqs.size(); ++i) {
+            std::cerr << "-- case: " << sources[i]->source << "\n";
+            try {
+                if (run_single_shot(*pv, reqs[i], out, err) != 0) ++n_failed;
+            } catch (const std::exception &e) {
+                pv->clear_images();
+                std::cerr << "error: " << sources[i]->source << ": " << e.what() << "\n";
+                ++n_failed;
+            }
+        }
+    }
+
+    double total_s = chr::duration<double>(chr::steady_clock::now() - batch_start).count();
+    fprintf(stderr, "batch: %zu case(s), %d model load(s), %d failed, %.1f s total\n",
+            cases.size() + n_invalid, n_loads, n_failed, total_s);
+    return n_failed == 0 ? 0 : 1;
+}
+
+// While a chat turn generates, Ctrl-C cancels the turn instead of ending the
+// program; the conversation continues with the partial reply
+static PiVision *volatile g_chat_pv = nullptr;
+
+static void on_chat_interrupt(int) {
+    if (g_chat_pv) g_chat_pv->cancel();
+}
+
+struct ChatInterruptScope {
+    struct sigaction prev {};
+
+    explicit ChatInterruptScope(PiVision &pv) {
+        g_chat_pv = &pv;
+        struct sigaction sa {};
+        sa.sa_handler = on_chat_interrupt;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, &prev);
+    }
+    ~ChatInterruptScope() {
+        sigaction(SIGINT, &prev, nullptr);
+        g_chat_pv = nullptr;
+    }
+};
+
+int main(int argc, char *argv[]) {
+    std::string model, vision, prompt, config_path, socket_path, batch_manifest, watch_dir, watch_out;
+    int watch_queue = 8;
+    std::string model_name;
+    int pool_mb_flag = -1;
+    std::vector<std::string> images, pin_files;
     bool json_mode = false;
+    bool json_stream = false;
     bool verbose = false;
     bool chat_mode = false;
     bool check_health_mode = false;
+    bool serve_mode = false;
+    // Tuning flags, in config-file form so they layer over the config (see make_config)
+    nlohmann::json cli = nlohmann::json::object();
+    nlohmann::json &perf = cli["performance"] = nlohmann::json::object();
+    nlohmann::json &generation = cli["generation"] = nlohmann::json::object();
+    nlohmann::json &sampler = cli["sampler"] = nlohmann::json::object();
 
     static struct option long_opts[] = {
         {"model", required_argument, nullptr, 'm'},
@@ -392,14 +1478,56 @@ int main(int argc, char *argv[]) {
         {"config", required_argument, nullptr, 'C'},
         {"chat", no_argument, nullptr, 'c'},
         {"json", no_argument, nullptr, 'j'},
+        {"json-stream", no_argument, nullptr, 'J'},
         {"verbose", no_argument, nullptr, 'V'},
         {"check-health", no_argument, nullptr, 'H'},
+        {"serve", no_argument, nullptr, 'S'},
+        {"socket", required_argument, nullptr, 's'},
+        {"model-name", required_argument, nullptr, 'f'},
+        {"pool-mb", required_argument, nullptr, 'z'},
+        {"batch", required_argument, nullptr, 'B'},
+        {"watch", required_argument, nullptr, 'w'},
+        {"watch-out", required_argument, nullptr, 'o'},
+        {"watch-queue", required_argument, nullptr, 'Q'},
+        {"embd-cache-dir", required_argument, nullptr, 'E'},
+        {"pin-prefix", required_argument, nullptr, 'P'},
+        {"context-policy", required_argument, nullptr, 'X'},
+        {"threads", required_argument, nullptr, 't'},
+        {"threads-batch", required_argument, nullptr, 'b'},
+        {"threads-vision", required_argument, nullptr, 'e'},
+        {"cpu-mask", required_argument, nullptr, 'k'},
+        {"draft-model", required_argument, nullptr, 'D'},
+        {"draft", required_argument, nullptr, 'n'},
+        {"parallel", required_argument, nullptr, 'N'},
+        {"no-mmap", no_argument, nullptr, 'M'},
+        {"mlock", no_argument, nullptr, 'L'},
+        {"prefetch", no_argument, nullptr, 'F'},
+        {"warmup", no_argument, nullptr, 'W'},
+        {"thermal-limit", required_argument, nullptr, 'T'},
+        {"n-ctx", required_argument, nullptr, 'x'},
+        {"no-memory-check", no_argument, nullptr, 'R'},
+        {"cache-type-k", required_argument, nullptr, 'K'},
+        {"cache-type-v", required_argument, nullptr, 'U'},
+        {"flash-attn", required_argument, nullptr, 'A'},
+        {"image-resize", required_argument, nullptr, 'I'},
+        {"max-tokens", required_argument, nullptr, 'G'},
+        {"max-wall-ms", required_argument, nullptr, 'l'},
+        {"stop", required_argument, nullptr, 'O'},
+        {"grammar-file", required_argument, nullptr, 'g'},
+        {"json-schema", required_argument, nullptr, 'Z'},
+        {"temp", required_argument, nullptr, 'a'},
+        {"greedy", no_argument, nullptr, 'Y'},
+        {"top-k", required_argument, nullptr, 'y'},
+        {"top-p", required_argument, nullptr, 'q'},
+        {"min-p", required_argument, nullptr, 'u'},
+        {"repeat-penalty", required_argument, nullptr, 'r'},
+        {"seed", required_argument, nullptr, 'd'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, 0, nullptr, 0}
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "m:v:i:p:C:cjVHh", long_opts, nullptr)) != -1) {
+    while ((opt = getopt_long(argc, argv, "m:v:i:p:C:cjJVHSs:f:z:B:E:P:X:t:b:e:k:D:n:N:MLFWT:x:RK:U:A:I:G:l:O:g:Z:a:Yy:q:u:r:d:w:o:Q:h", long_opts, nullptr)) != -1) {
         switch (opt) {
             case 'm': model  = optarg; break;
             case 'v': vision = optarg; break;
@@ -408,8 +1536,74 @@ int main(int argc, char *argv[]) {
             case 'C': config_path = optarg; break;
             case 'c': chat_mode = true; break;
             case 'j': json_mode = true; break;
+            case 'J': json_mode = json_stream = true; break;
             case 'V': verbose   = true; break;
             case 'H': check_health_mode = true; break;
+            case 'S': serve_mode = true; break;
+            case 's': socket_path = optarg; break;
+            case 'f': model_name = optarg; break;
+            case 'z': pool_mb_flag = std::max(std::atoi(optarg), 0); break;
+            case 'B': batch_manifest = optarg; break;
+            case 'w': watch_dir = optarg; break;
+            case 'o': watch_out = optarg; break;
+            case 'Q': watch_queue = std::atoi(optarg); break;
+            case 'E': cli["embd_cache_dir"] = optarg; break;
+            case 'P': pin_files.emplace_back(optarg); break;
+            case 'X': cli["context_policy"] = optarg; break;
+            case 't': perf["n_threads"] = std::atoi(optarg); break;
+            case 'b': perf["n_threads_batch"] = std::atoi(optarg); break;
+            case 'e': perf["n_threads_vision"] = std::atoi(optarg); break;
+            case 'k': perf["cpu_mask"] = optarg; break;
+            case 'D': cli["draft_model_path"] = optarg; break;
+            case 'n': perf["n_draft"] = std::atoi(optarg); break;
+            case 'N': perf["n_parallel"] = std::atoi(optarg); break;
+            case 'M': perf["use_mmap"] = false; break;
+            case 'L': perf["use_mlock"] = true; break;
+            case 'F': perf["prefetch"] = true; break;
+            case 'W': perf["warmup"] = true; break;
+            case 'T': {
+                // "<soft>" or "<soft>,<hard>"; hard defaults to soft + 5
+                nlohmann::json &thermal = perf["thermal"] = {{"soft_c", std::strtof(optarg, nullptr)}};
+                if (const char *comma = std::strchr(optarg, ','))
+                    thermal["hard_c"] = std::strtof(comma + 1, nullptr);
+                break;
+            }
+            case 'x':
+                if (std::strcmp(optarg, "auto") == 0) perf["n_ctx"] = "auto";
+                else perf["n_ctx"] = std::atoi(optarg);
+                break;
+            case 'R': perf["check_memory"] = false; break;
+            case 'K': perf["cache_type_k"] = optarg; break;
+            case 'U': perf["cache_type_v"] = optarg; break;
+            case 'A': perf["flash_attn"] = optarg; break;
+            case 'I':
+                if (std::isdigit(static_cast<unsigned char>(optarg[0]))) perf["image_resize"] = std::atoi(optarg);
+                else perf["image_resize"] = optarg;
+                break;
+            case 'G': generation["max_tokens"] = std::atoi(optarg); break;
+            case 'l': generation["max_wall_ms"] = std::atoi(optarg); break;
+            case 'O': generation["stop"].push_back(optarg); break;
+            case 'g': generation["grammar_file"] = optarg; break;
+            case 'Z':
+                // Inline schema, or a file holding one
+                if (optarg[0] != '{') {
+                    generation["json_schema"] = optarg;
+                    break;
+                }
+                try {
+                    generation["json_schema"] = nlohmann::json::parse(optarg);
+                } catch (const std::exception &e) {
+                    std::cerr << "error: --json-schema: " << e.what() << "\n";
+                    return 1;
+                }
+                break;
+            case 'a': sampler["temperature"] = std::atof(optarg); break;
+            case 'Y': sampler["greedy"] = true; break;
+            case 'y': sampler["top_k"] = std::atoi(optarg); break;
+            case 'q': sampler["top_p"] = std::atof(optarg); break;
+            case 'u': sampler["min_p"] = std::atof(optarg); break;
+            case 'r': sampler["repeat_penalty"] = std::atof(optarg); break;
+            case 'd': sampler["seed"] = std::atoi(optarg); break;
             case 'h': usage(argv[0]); return 0;
             default:  usage(argv[0]); return 1;
         }
@@ -418,35 +1612,79 @@ int main(int argc, char *argv[]) {
     if (check_health_mode)
         return check_health();
 
-    Config file_cfg = load_config(config_path);
+    // Flag values are checked before anything is loaded, in every mode
+    try {
+        make_config(Config{}, cli, verbose);
+        make_generation(Config{}, cli);
+    } catch (const std::exception &e) {
+        if (json_mode) print_json_error(e.what());
+        else           std::cerr << "error: " << e.what() << "\n";
+        return 1;
+    }
 
-    if (verbose && !file_cfg.source.empty())
-        std::cerr << "config loaded: " << file_cfg.source << "\n";
+    if (!batch_manifest.empty() && json_stream) {
+        std::cerr << "error: --json-stream cannot be combined with --batch\n";
+        return 1;
+    }
+    if (!batch_manifest.empty())
+        return run_batch(batch_manifest, cli, json_mode, verbose, pin_files);
 
-    if (!file_cfg.log_directory.empty())
-        g_log_directory = file_cfg.log_directory;
+    // --socket without --serve forwards the request to a running daemon
+    bool client_mode = !socket_path.empty() && !serve_mode;
+    if (socket_path.empty())
+        socket_path = DEFAULT_SOCKET;
 
-    if (model.empty()) {
-        if (!file_cfg.model_path.empty() && fs::exists(file_cfg.model_path)) {
-            model = file_cfg.model_path;
-            if (!json_mode) std::cerr << "using config model: " << model << "\n";
-        } else if (fs::exists(BUILTIN_MODEL)) {
-            model = BUILTIN_MODEL;
-            if (!json_mode) std::cerr << "using default model: " << model << "\n";
+    if (serve_mode && chat_mode) {
+        std::cerr << "error: --serve and --chat cannot be combined\n";
+        return 1;
+    }
+    if (client_mode && chat_mode) {
+        std::cerr << "error: --chat is not supported over --socket\n";
+        return 1;
+    }
+    if (!model_name.empty() && !client_mode) {
+        std::cerr << "error: --model-name picks a model of a running daemon and needs --socket\n";
+        return 1;
+    }
+    if (pool_mb_flag >= 0 && !serve_mode) {
+        std::cerr << "error: --pool-mb applies to --serve only\n";
+        return 1;
+    }
+    const bool watch_mode = !watch_dir.empty();
+    if (watch_mode) {
+        std::string err;
+        if (chat_mode || serve_mode || client_mode || json_stream)
+            err = "--watch cannot be combined with --chat, --serve, --socket or --json-stream";
+        else if (!fs::is_directory(watch_dir))
+            err = "not a directory: " + watch_dir;
+        else if (!watch_out.empty() && !fs::is_directory(watch_out))
+            err = "not a directory: " + watch_out;
+        else if (watch_queue < 1)
+            err = "--watch-queue must be at least 1";
+        if (!err.empty()) {
+            std::cerr << "error: " << err << "\n";
+            return 1;
         }
     }
 
-    if (vision.empty()) {
-        if (!file_cfg.vision_path.empty() && fs::exists(file_cfg.vision_path)) {
-            vision = file_cfg.vision_path;
-            if (!json_mode) std::cerr << "using config vision: " << vision << "\n";
-        } else if (fs::exists(BUILTIN_VISION)) {
-            vision = BUILTIN_VISION;
-            if (!json_mode) std::cerr << "using default vision: " << vision << "\n";
-        }
+    Config file_cfg;
+    GenerationParams gen;
+    try {
+        file_cfg = load_config(config_path);
+        gen = make_generation(file_cfg, cli);
+    } catch (const std::exception &e) {
+        if (json_mode) print_json_error(e.what());
+        else           std::cerr << "error: " << e.what() << "\n";
+        return 1;
     }
 
-    if (images.empty() && !file_cfg.default_image_path.empty()
+    if (verbose && !file_cfg.source.empty())
+        std::cerr << "config loaded: " << file_cfg.source << "\n";
+
+    if (!file_cfg.log_directory.empty())
+        g_log_directory = file_cfg.log_directory;
+
+    if (!serve_mode && !watch_mode && images.empty() && !file_cfg.default_image_path.empty()
         && fs::exists(file_cfg.default_image_path)) {
         images.push_back(file_cfg.default_image_path);
         if (!json_mode) std::cerr << "using config image: " << file_cfg.default_image_path << "\n";
@@ -458,14 +1696,14 @@ int main(int argc, char *argv[]) {
             prompt.assign(std::istreambuf_iterator<char>(pf), std::istreambuf_iterator<char>());
     }
 
-    if (!chat_mode && prompt.empty() && file_cfg.prompt.empty()) {
+    if (!chat_mode && !serve_mode && prompt.empty() && file_cfg.prompt.empty()) {
         if (json_mode) {
             print_json_error("missing --prompt argument and json key from config file");
             return 1;
         }
         usage(argv[0]);
         return 1;
-    } else if (!chat_mode && prompt.empty() && !file_cfg.prompt.empty()) {
+    } else if (!chat_mode && !serve_mode && prompt.empty() && !file_cfg.prompt.empty()) {
         const std::string &filepath = file_cfg.prompt;
         if (fs::is_regular_file(filepath)) {
             std::ifstream pf(filepath);
@@ -476,14 +1714,66 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (chat_mode && json_mode) {
-        std::cerr << "error: --chat and --json cannot be combined\n";
+    if (chat_mode && json_mode && !json_stream) {
+        std::cerr << "error: --chat and --json cannot be combined (use --json-stream)\n";
         return 1;
     }
 
-    // Auto-detect vision projector when images are given or in chat mode
-    if ((!images.empty() || chat_mode) && vision.empty()) {
+    std::vector<std::string> image_data(images.size());
+    for (size_t i = 0; i < images.size(); ++i) {
+        if (!is_stream_image(images[i])) continue;
+        if (chat_mode && images[i] == "-") {
+            std::cerr << "error: --image - cannot be combined with --chat (stdin is the chat input)\n";
+            return 1;
+        }
+        if (!read_stream_image(images[i], image_data[i])) {
+            std::string msg = "cannot read image from " + (images[i] == "-" ? std::string("stdin") : images[i]);
+            if (json_mode) print_json_error(msg);
+            else           std::cerr << "error: " << msg << "\n";
+            return 1;
+        }
+    }
+
+    if (client_mode) {
+        ShotRequest req;
+        req.prompt = prompt;
+        for (size_t i = 0; i < images.size(); ++i)  // the daemon has its own cwd
+            req.images.push_back(image_data[i].empty() ? fs::absolute(images[i]).string() : images[i]);
+        req.image_data = image_data;
+        req.gen = gen;
+        req.model = model_name;
+        req.log_directory = g_log_directory.empty() ? std::string() : fs::absolute(g_log_directory).string();
+        req.json_mode = json_mode;
+        req.stream = !json_mode || json_stream;
+        req.verbose = verbose;
+        return run_client(socket_path, req);
+    }
+
+    if (model.empty()) {
+        if (!file_cfg.model_path.empty() && fs::exists(file_cfg.model_path)) {
+            model = file_cfg.model_path;
+            if (!json_mode) std::cerr << "using config model: " << model << "\n";
+        } else if (fs::exists(BUILTIN_MODEL)) {
+            model = BUILTIN_MODEL;
+            if (!json_mode) std::cerr << "using default model: " << model << "\n";
+        }
+    }
+
+    if (vision.empty()) {
+        if (!file_cfg.vision_path.empty() && fs::exists(file_cfg.vision_path)) {
+            vision = file_cfg.vision_path;
+            if (!json_mode) std::cerr << "using config vision: " << vision << "\n";
+        } else if (fs::exists(BUILTIN_VISION)) {
+            vision = BUILTIN_VISION;
+            if (!json_mode) std::cerr << "using default vision: " << vision << "\n";
+        }
+    }
+
+    // Auto-detect vision projector when images are given, in chat mode, or for the daemon
+    bool vision_optional = chat_mode || serve_mode;
+    if ((!images.empty() || vision_optional || watch_mode) && vision.empty()) {
         fs::path model_dir = fs::path(model).parent_path();
+        if (model_dir.empty()) model_dir = ".";
         std::vector<std::string> candidates;
         for (const auto &entry : fs::directory_iterator(model_dir)) {
             const auto name = entry.path().filename().string();
@@ -501,7 +1791,7 @@ int main(int argc, char *argv[]) {
                 ? "no mmproj*.gguf found in " + model_dir.string() + " – provide --vision explicitly"
                 : "multiple mmproj*.gguf found in " + model_dir.string() + " – provide --vision to pick one";
 
-            if (chat_mode && candidates.empty()) {
+            if (vision_optional && candidates.empty()) {
                 std::cerr << "note: " << msg << "\n";
             } else {
                 if (json_mode) print_json_error(msg);
@@ -512,25 +1802,87 @@ int main(int argc, char *argv[]) {
     }
 
     try {
-        PiVisionConfig cfg;
+        PiVisionConfig cfg = make_config(file_cfg, cli, verbose);
         cfg.model_path = model;
         cfg.vision_path = vision;
-        cfg.verbose = verbose;
+
+        if (serve_mode) {
+            // The configured model answers requests that name none; a "models"
+            // entry for the same files lends it its name
+            std::string default_model = "default";
+            for (const auto &m : file_cfg.models)
+                if (m.model_path == model && m.vision_path == vision) default_model = m.name;
+
+            const int pool_mb = pool_mb_flag >= 0 ? pool_mb_flag : file_cfg.pool_memory_mb;
+            PiVisionPool pool(static_cast<size_t>(pool_mb) << 20, print_pool_event);
+            pool.add(default_model, cfg);
+            // Other models share the tuning of the config and command line
+            for (const auto &m : file_cfg.models) {
+                if (m.name == default_model) continue;
+                PiVisionConfig model_cfg = cfg;
+                model_cfg.model_path = m.model_path;
+                model_cfg.vision_path = m.vision_path;
+                pool.add(m.name, model_cfg);
+            }
+            return serve(pool, default_model, socket_path, gen, pin_files, verbose);
+        }
 
         PiVision pv(cfg);
+        if (verbose) {
+            fputs(format_memory_plan(pv.memory_plan()).c_str(), stderr);
+            fputs(format_load_stats(pv.load_timings()).c_str(), stderr);
+        }
+
+        if (watch_mode) {
+            pin_prefixes(pv, pin_files, verbose);
+            ShotRequest base;
+            base.prompt = prompt;
+            base.gen = gen;
+            base.log_directory = g_log_directory;
+            base.verbose = verbose;
+            base.resident = true;
+            return run_watch(pv, watch_dir, base, watch_out, watch_queue);
+        }
 
         if (chat_mode) {
             std::vector<std::string> turn_images;
 
+            // With --json-stream, stdout carries only NDJSON records and the
+            // interactive chrome moves to stderr
+            std::ostream &ui = json_stream ? std::cerr : std::cout;
+            auto chat_turn = [&](const std::string &msg) {
+                RunResult r;
+                ChatInterruptScope interrupt(pv);
+                if (json_stream) {
+                    r = pv.chat_turn_events(msg,
+                        [](const TokenEvent &ev) { std::cout << format_token_event(ev) << std::flush; }, gen);
+                    std::cout << format_stream_result(r) << std::flush;
+                    ui << "\n";
+                } else {
+                    r = pv.chat_turn(msg, [](const std::string &piece) { std::cout << piece << std::flush; }, gen);
+                    if (r.stop_reason == "cancelled") std::cout << " [cancelled]";
+                    std::cout << "\n\n";
+                }
+                if (verbose) print_stats(r);
+                save_log(msg, turn_images, r);
+                turn_images.clear();
+            };
+
             if (!images.empty()) {
-                std::string err = pv.validate(images);
+                std::vector<std::string> files;
+                for (size_t idx = 0; idx < images.size(); ++idx)
+                    if (image_data[idx].empty()) files.push_back(images[idx]);
+                std::string err = pv.validate(files);
                 if (!err.empty()) {
                     std::cerr << "error: " << err << "\n";
                     return 1;
                 }
                 for (size_t idx = 0; idx < images.size(); ++idx) {
                     const auto &img = images[idx];
-                    if (!pv.load_image(img)) {
+                    const std::string &data = image_data[idx];
+                    bool loaded = data.empty() ? pv.load_image(img)
+                                               : pv.load_image_buffer(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+                    if (!loaded) {
                         std::cerr << "failed to load image: " << img << "\n";
                         return 1;
                     }
@@ -540,21 +1892,16 @@ int main(int argc, char *argv[]) {
                 turn_images = images;
             }
 
-            std::cout << "pivision chat (type /quit to exit, /help for commands)\n\n";
+            ui << "pivision chat (type /quit to exit, /help for commands)\n\n";
 
             if (!prompt.empty()) {
-                std::cout << "> " << prompt << "\n";
-                RunResult turn_result = pv.chat_turn(prompt,
-                    [](const std::string &piece) { std::cout << piece << std::flush; });
-                std::cout << "\n\n";
-                if (verbose) print_stats(turn_result);
-                save_log(prompt, turn_images, turn_result);
-                turn_images.clear();
+                ui << "> " << prompt << "\n";
+                chat_turn(prompt);
             }
 
             std::string line;
             while (true) {
-                std::cout << "> " << std::flush;
+                ui << "> " << std::flush;
                 if (!std::getline(std::cin, line)) break;
 
                 size_t start = line.find_first_not_of(" \t");
@@ -566,15 +1913,35 @@ int main(int argc, char *argv[]) {
                 if (line == "/clear") {
                     pv.chat_clear();
                     turn_images.clear();
-                    std::cout << "conversation cleared\n\n";
+                    ui << "conversation cleared\n\n";
                     continue;
                 }
 
                 if (line == "/help") {
-                    std::cout << "Commands:\n"
+                    ui << "Commands:\n"
                               << "  /image <path>  Load an image for the next message\n"
                               << "  /clear         Reset conversation\n"
-                              << "  /quit          Exit\n\n";
+                              << "  /save <file>   Save the conversation and its KV cache\n"
+                              << "  /load <file>   Resume a saved conversation\n"
+                              << "  /quit          Exit\n"
+                              << "Ctrl-C while a reply is generating stops it; the conversation continues.\n\n";
+                    continue;
+                }
+
+                if (line.rfind("/save ", 0) == 0 || line.rfind("/load ", 0) == 0) {
+                    const bool saving = line[1] == 's';
+                    std::string path = line.substr(6);
+                    size_t ps = path.find_first_not_of(" \t");
+                    if (ps != std::string::npos) path = path.substr(ps);
+
+                    SessionIO io = saving ? pv.save_session(path) : pv.load_session(path);
+                    if (!io.ok) {
+                        std::cerr << "error: " << io.error << "\n";
+                        continue;
+                    }
+                    if (!saving) turn_images.clear();
+                    ui << (saving ? "saved: " : "loaded: ") << path << "\n\n";
+                    if (verbose) fputs(format_session_stats(saving ? "save" : "load", io).c_str(), stderr);
                     continue;
                 }
 
@@ -593,46 +1960,25 @@ int main(int argc, char *argv[]) {
                         continue;
                     }
                     turn_images.push_back(img_path);
-                    std::cout << "loaded: " << img_path << "\n\n";
+                    ui << "loaded: " << img_path << "\n\n";
                     continue;
                 }
 
-                RunResult turn_result = pv.chat_turn(line,
-                    [](const std::string &piece) { std::cout << piece << std::flush; });
-                std::cout << "\n\n";
-                if (verbose) print_stats(turn_result);
-                save_log(line, turn_images, turn_result);
-                turn_images.clear();
+                chat_turn(line);
             }
         } else {
-            if (!images.empty()) {
-                std::string err = pv.validate(images);
-                if (!err.empty()) {
-                    if (json_mode) print_json_error(err);
-                    else std::cerr << "error: " << err << "\n";
-                    return 1;
-                }
-                for (size_t idx = 0; idx < images.size(); ++idx) {
-                    const auto &img = images[idx];
-                    if (!pv.load_image(img)) {
-                        std::string msg = "failed to load image: " + img;
-                        if (json_mode) print_json_error(msg);
-                        else std::cerr << msg << "\n";
-                        return 1;
-                    }
-                    if (verbose)
-                        std::cerr << "Image " << (idx + 1) << ": " << img << "\n";
-                }
-            }
-
-            RunResult result = pv.run_collect(prompt);
-            if (json_mode)
-                print_json_result(result);
-            else
-                std::cout << result.content << "\n";
-
-            if (verbose) print_stats(result);
-            save_log(prompt, images, result);
+            ShotRequest req;
+            req.prompt = prompt;
+            req.images = images;
+            req.image_data = std::move(image_data);
+            req.gen = gen;
+            req.log_directory = g_log_directory;
+            req.json_mode = json_mode;
+            req.stream = json_stream;
+            req.verbose = verbose;
+            return run_single_shot(pv, req,
+                [](const std::string &s) { std::cout << s << std::flush; },
+                [](const std::string &s) { std::cerr << s; });
         }
 
     } catch (const std::exception &e) {
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <string>
@@ -9,22 +11,274 @@ struct PiVisionConfig {
     std::string model_path;    // Path to gguf
     std::string vision_path;   // Path to mmproj
     int         n_ctx        = 2048;
-    float       temperature  = 0.1f;
+    int         n_batch      = 512;   // logical batch: tokens submitted per llama_decode
+    int         n_ubatch     = 0;     // physical batch computed at once; 0 = n_batch
     bool        verbose      = false;
+
+    // Sampler chain: repetition penalty > top_k > top_p > min_p > temperature >
+    // seeded draw. temperature 0 (or top_k 1) samples greedily; without a
+    // repetition penalty the token is then just the argmax of the logits.
+    float       temperature    = 0.1f;
+    int         top_k          = 40;     // 0 = off
+    float       top_p          = 0.95f;  // 1 = off
+    float       min_p          = 0.0f;   // 0 = off
+    float       repeat_penalty = 1.0f;   // 1 = off
+    int         repeat_last_n  = 64;     // tokens the penalty looks back over
+    int         seed           = 42;     // -1 = random
+
+    // Images are decoded on the decode workers and, when larger than the
+    // projector's input, shrunk there so that their shorter side is
+    // image_resize pixels. 0 = the input size of a fixed-resolution projector
+    // (projectors that tile or take dynamic resolutions get full frames);
+    // -1 = always keep the full resolution.
+    int         image_resize = 0;
+
+    // Encoded image embeddings, keyed by image content + projector
+    int         embd_cache_entries = 8;  // in-memory entries (0 with no dir disables the cache)
+    std::string embd_cache_dir;          // optional directory of mmap-able .embd files
+
+    // Single-shot runs reuse the KV cache of the longest prompt prefix they share
+    // with the previous run or a pinned prefix, and only decode the rest
+    bool        prompt_cache        = true;
+    int         max_pinned_prefixes = 2;
+
+    // What a chat does when the context fills up: "sliding_window" drops the
+    // oldest turns after the first one and shifts the rest down, "none" stops
+    // generating at n_ctx
+    std::string context_policy = "sliding_window";
+
+    // Threads for token generation, prompt prefill and the vision encoder.
+    // 0 = derive: batch follows n_threads, vision follows batch, and without
+    // explicit counts the cpu mask size (or llama.cpp's default) is used.
+    int         n_threads        = 0;
+    int         n_threads_batch  = 0;
+    int         n_threads_vision = 0;
+    // CPUs inference may run on, as a list ("0-3,6") or hex mask ("0xf").
+    // Empty = no restriction.
+    std::string cpu_mask;
+
+    // Speculative decoding: a small model with the same vocabulary proposes up
+    // to n_draft tokens that the main model verifies in one batch. The draft
+    // model sees only the text of the prompt.
+    std::string draft_model_path;
+    int         n_draft = 8;
+
+    // Requests run_batch() keeps in flight at once, each in its own sequence
+    int         n_parallel = 4;
+
+    // Model startup. use_mmap = false reads the weights into memory instead of
+    // mapping them and use_mlock keeps them resident. prefetch starts kernel
+    // readahead of the model files before they are parsed; warmup runs one
+    // throwaway decode so the first request does not pay for page faults and
+    // buffer allocation.
+    bool        use_mmap  = true;
+    bool        use_mlock = false;
+    bool        prefetch  = false;
+    bool        warmup    = false;
+
+    // Thermal governor: while generating, read thermal_zone every
+    // thermal_sample_ms; above thermal_soft_c drop generation threads one at a
+    // time, above thermal_hard_c halve them and pace tokens, so throughput
+    // degrades smoothly instead of hitting firmware throttling
+    bool        thermal_governor    = false;
+    std::string thermal_zone        = "/sys/class/thermal/thermal_zone0/temp";
+    float       thermal_soft_c      = 75.0f;
+    float       thermal_hard_c      = 80.0f;
+    int         thermal_sample_ms   = 500;
+    int         thermal_min_threads = 1;
+
+    // KV cache element types: f16, bf16, f32, q8_0, q5_1, q5_0, q4_1, q4_0.
+    // Quantized types shrink the KV cache (q8_0 about halves it); a quantized
+    // V cache needs flash attention. flash_attn is "auto", "on" or "off".
+    std::string cache_type_k = "f16";
+    std::string cache_type_v = "f16";
+    std::string flash_attn   = "auto";
+
+    // Memory planning from GGUF metadata and MemAvailable. check_memory refuses
+    // to load when the estimated peak exceeds available memory; auto_n_ctx
+    // instead picks the largest n_ctx (up to the model's training context)
+    // that fits, shrinking n_batch only if needed. n_ctx is the total across
+    // sequences.
+    bool        check_memory     = true;
+    bool        auto_n_ctx       = false;
+    int         memory_margin_mb = 256;   // headroom kept free for the OS and other processes
+};
+
+// Estimated peak memory of a configuration (bytes)
+struct MemoryPlan {
+    bool        fits            = true;
+    std::string error;                  // metadata unreadable; the other fields are unset
+    int         n_ctx           = 0;    // context the estimate is for (chosen one with auto_n_ctx)
+    int         n_batch         = 0;
+    int         n_ctx_train     = 0;
+    size_t      weights_bytes   = 0;    // LLM tensors
+    size_t      projector_bytes = 0;    // projector tensors + encoder activations
+    size_t      draft_bytes     = 0;    // draft model tensors, KV and compute
+    size_t      kv_bytes        = 0;
+    size_t      compute_bytes   = 0;    // rough upper bound on compute buffers
+    size_t      margin_bytes    = 0;
+    size_t      total_bytes     = 0;
+    size_t      available_bytes = 0;    // MemAvailable, 0 if unknown
+};
+
+// Where the constructor spent its time (ms)
+struct LoadTimings {
+    double prefetch_ms  = 0.0;  // readahead requests for the model files
+    double model_ms     = 0.0;  // open, parse and map (or read) the LLM weights
+    double template_ms  = 0.0;  // chat template init
+    double context_ms   = 0.0;  // llama context + KV cache allocation
+    double projector_ms = 0.0;  // vision projector load
+    double draft_ms     = 0.0;  // draft model + context
+    double warmup_ms    = 0.0;
+    double total_ms     = 0.0;  // whole constructor, same as RunResult::load_ms
+    bool   use_mmap     = true;
+    bool   use_mlock    = false;
+};
+
+// One thermal governor reading during generation
+struct ThermalSample {
+    double      t_ms      = 0.0;  // since the request started
+    float       temp_c    = 0.0f;
+    int         n_threads = 0;    // generation threads after this sample
+    double      pace_ms   = 0.0;  // per-token pause after this sample
+    std::string action;           // what the governor changed, empty if nothing
 };
 
 struct RunResult {
     std::string content;           // Model response
     std::string model_desc;        // Model name
     int         images_processed = 0;
-    int         prompt_tokens    = 0;  
+    int         prompt_tokens    = 0;  // prompt tokens decoded for this request
+    int         prompt_tokens_reused = 0;  // prompt tokens served from the KV cache
     int         gen_tokens       = 0;  
     int         total_tokens     = 0;  // Sum of prompt tokens and generated tokens
     double      tokens_per_sec   = 0.0;
     double      prompt_ms        = 0.0;  // prompt eval time (ms)
     double      gen_ms           = 0.0;  // generation time (ms)
-    double      ttft_ms          = 0.0;  // time to first token (ms)
+    double      ttft_ms          = 0.0;  // request start to first generated piece, incl. image work and prefill (ms)
     double      wall_ms          = 0.0;  // total time from start to finish (wall time) (ms)
+    double      load_ms          = 0.0;  // model load time charged to this request, first request only (ms)
+    int         embd_cache_hits     = 0;    // images decoded from a cached embedding
+    int         embd_cache_misses   = 0;    // images that ran the vision encoder
+    double      embd_cache_saved_ms = 0.0;  // encoder time avoided by cache hits (ms)
+    std::string context_policy;             // PiVisionConfig::context_policy in effect
+    int         tokens_evicted      = 0;    // KV positions dropped from old chat turns this turn
+    int         n_threads        = 0;  // effective generation threads
+    int         n_threads_batch  = 0;  // effective prefill threads
+    int         n_threads_vision = 0;  // effective vision encoder threads
+    std::string cpu_mask;              // affinity in effect (empty = none)
+    std::vector<double> image_decode_ms;  // decode time of each image, in load order (ms)
+    std::vector<double> image_resize_ms;  // downscale time of each image; 0 when kept as is (ms)
+    size_t      image_peak_bytes = 0;     // largest pixel buffers held while ingesting one image
+    double      image_wait_ms    = 0.0;   // time the run blocked waiting for decodes (ms)
+    int         draft_tokens     = 0;     // tokens proposed by the draft model
+    int         draft_accepted   = 0;     // proposals the main model kept
+    double      draft_acceptance = 0.0;   // draft_accepted / draft_tokens
+    double      draft_ms         = 0.0;   // drafting time, included in tokens_per_sec (ms)
+    // Per-phase breakdown (ms). Image file decode is image_decode_ms above;
+    // prompt_ms = image_embd_ms + prefill_ms
+    double      tokenize_ms      = 0.0;   // prompt tokenization incl. image preprocessing
+    double      encode_ms        = 0.0;   // vision encoder (0 for embedding cache hits)
+    double      image_embd_ms    = 0.0;   // image embeddings decoded into the KV cache
+    double      prefill_ms       = 0.0;   // text prompt decode
+    double      sample_ms        = 0.0;   // sampler chain, all generated tokens
+    std::string sampler;                  // sampler chain in effect, e.g. "greedy"
+    double      detok_ms         = 0.0;   // token to text conversion
+    std::vector<ThermalSample> thermal_trace;  // empty unless the governor is on
+    int         thermal_actions  = 0;     // samples where the governor changed something
+    double      thermal_pause_ms = 0.0;   // pacing inserted by the governor (ms)
+    float       temp_max_c       = 0.0f;  // hottest reading this request
+    std::string kv_type_k;                // KV cache types and attention path in effect
+    std::string kv_type_v;
+    std::string flash_attn;
+    size_t      kv_bytes         = 0;     // size of the whole KV cache (all sequences)
+    // Why generation ended: "eos" (end of generation token), "max_tokens",
+    // "stop" (a stop string matched), "context" (context full), "cancelled"
+    // (PiVision::cancel() or RunHandle::cancel()), "deadline" (past
+    // GenerationParams::max_wall_ms) or "error". content holds what was
+    // generated up to that point.
+    std::string stop_reason;
+    std::string error;                    // set when a run_batch() request failed
+};
+
+// One generated piece of text, as passed to run_events() / chat_turn_events()
+struct TokenEvent {
+    std::string piece;        // detokenized text (may be a partial UTF-8 sequence)
+    int         token = -1;   // vocabulary id; -1 for text held back for a stop string and released at the end
+    int         index = 0;    // 0-based piece number within the request
+    double      t_ms  = 0.0;  // time since the request started (ms, monotonic clock)
+    double      dt_ms = 0.0;  // time since the previous piece; t_ms for the first (ms)
+};
+
+using TokenCallback = std::function<void(const TokenEvent&)>;
+
+// Per-request limits on the reply. Generation ends at the first of: end of
+// generation, max_tokens, a stop string, a full context, max_wall_ms, or a
+// cancel.
+struct GenerationParams {
+    int                      max_tokens = 0;  // 0 = no limit
+    // Wall time budget from the start of the request, image work and prefill
+    // included; checked between decode steps. 0 = no limit
+    int                      max_wall_ms = 0;
+    // The reply ends before the first occurrence of any of these, which is
+    // not returned. Streamed text that could be the start of a stop string
+    // is held back until it is known not to be.
+    std::vector<std::string> stop;
+    // Constrained decoding: a GBNF grammar (root rule "root"), or a JSON
+    // schema that is converted to one. At most one of the two.
+    std::string              grammar;
+    std::string              json_schema;
+};
+
+struct BatchRequest {
+    std::string              prompt;
+    std::vector<std::string> image_paths;
+    int                      max_tokens = 512;  // reply budget, reserved in the KV cache
+    GenerationParams         gen;               // stop strings and grammar; gen.max_tokens > 0 replaces max_tokens
+};
+
+struct BatchResult {
+    std::vector<RunResult> results;       // one per request, in request order
+    int         prompt_tokens  = 0;
+    int         gen_tokens     = 0;       // over all requests
+    double      tokens_per_sec = 0.0;     // aggregate: gen_tokens / wall time
+    double      wall_ms        = 0.0;
+    double      load_ms        = 0.0;     // model load time, first request only (ms)
+    int         peak_parallel  = 0;       // most requests decoded together
+};
+
+// Outcome of PiVision::save_session() / load_session()
+struct SessionIO {
+    bool        ok       = false;
+    std::string error;           // set when !ok
+    size_t      bytes    = 0;    // session file size
+    int         n_tokens = 0;    // KV positions saved / restored
+    double      ms       = 0.0;  // time to write / restore the session (ms)
+};
+
+// A run started by PiVision::run_async(). Copies share the request; the last
+// one to go waits for it to finish.
+class RunHandle {
+public:
+    bool valid() const { return state_ != nullptr; }
+
+    // Ask the request to stop at the next decode step, or not to start, and
+    // return at once; its result then has stop_reason "cancelled" and the
+    // reply so far
+    void cancel();
+
+    // Whether the result is available; wait_for() first waits up to
+    // timeout_ms for it
+    bool ready() const;
+    bool wait_for(int timeout_ms) const;
+
+    // Waits for the result; rethrows what the run threw. Only once per request.
+    RunResult get();
+
+private:
+    friend class PiVision;
+    struct State;
+    std::shared_ptr<State> state_;
 };
 
 class PiVision {
@@ -37,25 +291,137 @@ public:
 
     std::string validate(const std::vector<std::string>& image_paths) const;
 
+    const LoadTimings& load_timings() const;
+
+    // Estimate for `config` without loading it (honours auto_n_ctx), and the
+    // plan this instance was created with
+    static MemoryPlan plan_memory(const PiVisionConfig& config);
+    const MemoryPlan& memory_plan() const;
+
     bool load_image(const std::string& path);
 
-    // Streaming interface
-    void run(const std::string& prompt,
-             std::function<void(const std::string&)> stream_cb);
+    // Load an encoded JPEG or PNG image from memory, e.g. a captured frame or
+    // stdin. The bytes are decoded in place during the call and not kept.
+    bool load_image_buffer(const uint8_t* data, size_t size);
+
+    // Load a raw frame of packed RGB pixels (3 bytes per pixel, rows `stride`
+    // bytes apart; 0 = width * 3). The frame is read in place during the call:
+    // shrunk straight from it when larger than the projector's input (see
+    // PiVisionConfig::image_resize), else copied once into the bitmap.
+    bool load_image_rgb(const uint8_t* rgb, int width, int height, int stride = 0);
+
+    // Queue an image for decoding on a background worker and return at once.
+    // Several images decode in parallel while the caller continues; the next
+    // run()/chat_turn() waits for them and throws if one failed to decode.
+    void load_image_async(const std::string& path);
+
+    // Drop images loaded via load_image() that no run has consumed yet
+    void clear_images();
+
+    // Streaming interface – pieces go to stream_cb, metadata is returned.
+    // Throws std::runtime_error for an invalid grammar or JSON schema in gen.
+    RunResult run(const std::string& prompt,
+                  std::function<void(const std::string&)> stream_cb,
+                  const GenerationParams& gen = {});
+
+    // Like run_events(), on a thread of its own: returns at once, and event_cb
+    // is called from that thread. Requests still run one at a time, so the
+    // instance must not be used again until the handle is ready.
+    RunHandle run_async(const std::string& prompt, TokenCallback event_cb = nullptr,
+                        const GenerationParams& gen = {});
+
+    // Stop the latest request (run, chat turn, batch, or a run_async() one
+    // that has not started yet) at its next decode step; it returns with
+    // stop_reason "cancelled". Safe to call from another thread or a signal
+    // handler. No effect once that request has finished.
+    void cancel();
 
     // Batch interface – runs inference and returns the full result w/ metadata
-    RunResult run_collect(const std::string& prompt);
+    RunResult run_collect(const std::string& prompt, const GenerationParams& gen = {});
+
+    // Like run(), with token ids and per-piece timestamps
+    RunResult run_events(const std::string& prompt, TokenCallback event_cb,
+                         const GenerationParams& gen = {});
 
     // Multi-turn chat using KV cache
 
     // Run one chat turn. Images loaded via load_image() apply to this turn
     RunResult chat_turn(const std::string& user_message,
-                        std::function<void(const std::string&)> stream_cb);
-    RunResult chat_turn_collect(const std::string& user_message);
+                        std::function<void(const std::string&)> stream_cb,
+                        const GenerationParams& gen = {});
+    RunResult chat_turn_collect(const std::string& user_message, const GenerationParams& gen = {});
+    RunResult chat_turn_events(const std::string& user_message, TokenCallback event_cb,
+                               const GenerationParams& gen = {});
+
+    // Keep the KV cache of a single-shot prompt head (the start of the user text,
+    // after any images loaded via load_image()) under `name`, so later run() /
+    // run_collect() calls that start the same way skip re-evaluating it.
+    // Returns false when no pin slot is free or the prompt cache is disabled.
+    bool pin_prefix(const std::string& name, const std::string& prefix);
+    void unpin_prefix(const std::string& name);
 
     // Reset the conversation (clears KV cache + history)
     void chat_clear();
 
+    // Run independent single-shot requests concurrently: each gets its own
+    // sequence in the shared context and their decode steps are batched.
+    // Leaves the conversation and any loaded images untouched. Speculative
+    // decoding and prompt-prefix reuse do not apply here.
+    BatchResult run_batch(const std::vector<BatchRequest>& requests);
+
+    // Persist the conversation (history + KV cache) so it can be resumed later
+    // without re-encoding images or re-evaluating past turns. load_session()
+    // replaces the current conversation; the file must come from the same model.
+    SessionIO save_session(const std::string& path);
+    SessionIO load_session(const std::string& path);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+// One PiVisionPool event
+struct PoolEvent {
+    std::string type;                  // "hit" (already resident), "load" or "evict"
+    std::string name;
+    double      ms             = 0.0;  // lookup, load or unload time (ms)
+    size_t      bytes          = 0;    // planned memory of the model (MemoryPlan, less the margin)
+    size_t      resident_bytes = 0;    // planned memory of all resident models afterwards
+};
+
+using PoolEventCallback = std::function<void(const PoolEvent&)>;
+
+// Named models kept loaded side by side, so requests can switch between them
+// without reloading. Each model is a whole PiVision instance (weights,
+// projector, context). A model is loaded on first use; when it would not fit,
+// the least recently used models are unloaded first, until the planned memory
+// (MemoryPlan) of the resident models stays within memory_cap and, for
+// configurations that check memory, within MemAvailable as it was when the
+// pool was created.
+class PiVisionPool {
+public:
+    // memory_cap in bytes; 0 = only the MemAvailable limit
+    explicit PiVisionPool(size_t memory_cap = 0, PoolEventCallback on_event = nullptr);
+    ~PiVisionPool();
+
+    PiVisionPool(const PiVisionPool&)            = delete;
+    PiVisionPool& operator=(const PiVisionPool&) = delete;
+
+    // Register a model under `name`; replacing one unloads its old instance
+    void add(const std::string& name, const PiVisionConfig& config);
+    bool has(const std::string& name) const;
+    std::vector<std::string> names() const;  // in the order they were added
+
+    // The instance for `name`, loaded first if it is not resident. The
+    // reference stays valid until that model is evicted, i.e. until the next
+    // get() of another model or evict(). Throws std::runtime_error for an
+    // unknown name, a model larger than the budget, or a failed load.
+    PiVision& get(const std::string& name);
+
+    bool resident(const std::string& name) const;
+    void evict(const std::string& name);
+    size_t resident_bytes() const;
+
 private:
     struct Impl;
     std::unique_ptr<Impl> impl_;
@@ -7,15 +7,48 @@
 #include "stb_image.h"
 
 #include "llama.h"
+#include "gguf.h"
+#include "common.h"
 #include "chat.h"
+#include "json-schema-to-grammar.h"
 #include "mtmd.h"
 #include "mtmd-helper.h"
 
+#include <nlohmann/json.hpp>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 static void quiet_log_callback(ggml_log_level level, const char *text, void *) {
@@ -23,16 +56,9 @@ static void quiet_log_callback(ggml_log_level level, const char *text, void *) {
         fputs(text, stderr);
 }
 
-static bool is_valid_image_format(const std::string &path) {
-    std::ifstream f(path, std::ios::binary);
-    if (!f) return false;
-
-    unsigned char hdr[4] = {};
-    f.read(reinterpret_cast<char *>(hdr), 4);
-    if (!f) return false;
-
-    if (hdr[0] == 0xFF && hdr[1] == 0xD8 && hdr[2] == 0xFF) return true; // jpg
-    if (hdr[0] == 0x89 && hdr[1] == 0x50 && hdr[2] == 0x4E && hdr[3] == 0x47) return true; // png
+static bool is_image_header(const unsigned char *hdr, size_t n) {
+    if (n >= 3 && hdr[0] == 0xFF && hdr[1] == 0xD8 && hdr[2] == 0xFF) return true; // jpg
+    if (n >= 4 && hdr[0] == 0x89 && hdr[1] == 0x50 && hdr[2] == 0x4E && hdr[3] == 0x47) return true; // png
     return false;
 }
 
@@ -60,7 +86,802 @@ static std::string format_chat_prompt(const char *chat_template, const std::stri
     return std::string(buf.data(), static_cast<size_t>(len));
 }
 
+// 64-bit content hash used to key cached image embeddings
+static uint64_t hash_bytes(const unsigned char *data, size_t n, uint64_t h = 0x9E3779B97F4A7C15ull) {
+    const uint64_t mul = 0x100000001B3ull;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, data + i, 8);
+        h = (h ^ w) * mul;
+        h ^= h >> 29;
+    }
+    for (; i < n; ++i)
+        h = (h ^ data[i]) * mul;
+    return h;
+}
+
+static std::string hex64(uint64_t v) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(v));
+    return buf;
+}
+
+// Identifies a projector file without reading it: path, size and mtime
+static std::string projector_identity(const std::string &path) {
+    struct stat st {};
+    std::string id = path;
+    if (stat(path.c_str(), &st) == 0) {
+        id += ':' + std::to_string(static_cast<long long>(st.st_size));
+        id += ':' + std::to_string(static_cast<long long>(st.st_mtime));
+    }
+    return hex64(hash_bytes(reinterpret_cast<const unsigned char *>(id.data()), id.size()));
+}
+
+// Starts kernel readahead of a whole file so the pages are (being) read by
+// the time the loader touches them; on slow storage this overlaps the I/O
+// with gguf parsing instead of faulting the weights in one page at a time
+static void prefetch_file(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+// Temperature in °C from a sysfs thermal zone (millidegrees), NaN when unreadable
+static float read_temp_c(const std::string &path) {
+    std::ifstream f(path);
+    long milli = 0;
+    if (!(f >> milli)) return NAN;
+    return milli / 1000.0f;
+}
+
+// ---------- Memory planner ----------
+
+// What the planner needs from a GGUF header; tensor data is not read
+struct GgufInfo {
+    size_t   tensor_bytes = 0;
+    uint32_t n_layer      = 0;
+    uint32_t n_embd       = 0;
+    uint32_t n_head       = 0;
+    uint64_t n_embd_k     = 0;  // K head width × KV heads, summed over layers
+    uint64_t n_embd_v     = 0;
+    uint32_t n_ff         = 0;
+    uint32_t n_ctx_train  = 0;
+    uint32_t n_vocab      = 0;
+};
+
+static uint64_t gguf_uint(const gguf_context *g, const std::string &key, uint64_t dflt) {
+    const int64_t id = gguf_find_key(g, key.c_str());
+    if (id < 0) return dflt;
+    switch (gguf_get_kv_type(g, id)) {
+        case GGUF_TYPE_UINT32: return gguf_get_val_u32(g, id);
+        case GGUF_TYPE_INT32:  return static_cast<uint64_t>(std::max(gguf_get_val_i32(g, id), 0));
+        case GGUF_TYPE_UINT64: return gguf_get_val_u64(g, id);
+        case GGUF_TYPE_ARRAY: {
+            // Per-layer values (e.g. head_count_kv on hybrid models): use the largest
+            const size_t n = gguf_get_arr_n(g, id);
+            const void *data = gguf_get_arr_data(g, id);
+            const gguf_type t = gguf_get_arr_type(g, id);
+            uint64_t v = 0;
+            for (size_t i = 0; i < n; ++i) {
+                if (t == GGUF_TYPE_UINT32)     v = std::max<uint64_t>(v, static_cast<const uint32_t *>(data)[i]);
+                else if (t == GGUF_TYPE_INT32) v = std::max<uint64_t>(v, std::max(static_cast<const int32_t *>(data)[i], 0));
+            }
+            return n > 0 ? v : dflt;
+        }
+        default: return dflt;
+    }
+}
+
+static bool read_gguf_info(const std::string &path, GgufInfo &out, bool text_model) {
+    gguf_init_params params = {true, nullptr};
+    gguf_context *g = gguf_init_from_file(path.c_str(), params);
+    if (!g) return false;
+
+    for (int64_t i = 0; i < gguf_get_n_tensors(g); ++i)
+        out.tensor_bytes += gguf_get_tensor_size(g, i);
+
+    if (text_model) {
+        const int64_t arch_id = gguf_find_key(g, "general.architecture");
+        const std::string arch = arch_id >= 0 ? gguf_get_val_str(g, arch_id) : "llama";
+        out.n_layer     = static_cast<uint32_t>(gguf_uint(g, arch + ".block_count", 0));
+        out.n_embd      = static_cast<uint32_t>(gguf_uint(g, arch + ".embedding_length", 0));
+        out.n_head      = static_cast<uint32_t>(gguf_uint(g, arch + ".attention.head_count", 1));
+        out.n_ff        = static_cast<uint32_t>(gguf_uint(g, arch + ".feed_forward_length", 4ull * out.n_embd));
+        out.n_ctx_train = static_cast<uint32_t>(gguf_uint(g, arch + ".context_length", 4096));
+        const uint64_t n_head_kv = gguf_uint(g, arch + ".attention.head_count_kv", out.n_head);
+        const uint64_t head_dim = out.n_head > 0 ? out.n_embd / out.n_head : out.n_embd;
+        const uint64_t head_k = gguf_uint(g, arch + ".attention.key_length", head_dim);
+        const uint64_t head_v = gguf_uint(g, arch + ".attention.value_length", head_dim);
+        out.n_embd_k = head_k * n_head_kv * out.n_layer;
+        out.n_embd_v = head_v * n_head_kv * out.n_layer;
+        const int64_t tok_id = gguf_find_key(g, "tokenizer.ggml.tokens");
+        out.n_vocab = tok_id >= 0 ? static_cast<uint32_t>(gguf_get_arr_n(g, tok_id)) : 32000;
+    }
+    gguf_free(g);
+    return true;
+}
+
+// Input size of a fixed-resolution projector, or 0 when it tiles the image
+// or takes dynamic resolutions, where a smaller frame would change what it sees
+static int projector_image_side(const std::string &path) {
+    gguf_init_params params = {true, nullptr};
+    gguf_context *g = gguf_init_from_file(path.c_str(), params);
+    if (!g) return 0;
+
+    int side = static_cast<int>(gguf_uint(g, "clip.vision.image_size", 0));
+    if (gguf_find_key(g, "clip.vision.image_grid_pinpoints") >= 0 || gguf_find_key(g, "clip.minicpmv_version") >= 0)
+        side = 0;
+    const int64_t type_id = gguf_find_key(g, "clip.projector_type");
+    const std::string type = type_id >= 0 ? gguf_get_val_str(g, type_id) : "";
+    for (const char *dynamic : {"qwen", "pixtral", "idefics3", "internvl", "kimivl", "llama4", "lfm2"})
+        if (type.compare(0, std::strlen(dynamic), dynamic) == 0)
+            side = 0;
+    gguf_free(g);
+    return side;
+}
+
+static size_t mem_available_bytes() {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string line;
+    while (std::getline(meminfo, line)) {
+        long kb = 0;
+        if (sscanf(line.c_str(), "MemAvailable: %ld", &kb) == 1)
+            return static_cast<size_t>(kb) * 1024;
+    }
+    return 0;
+}
+
+// "f16", "q8_0", ... as accepted for PiVisionConfig::cache_type_k / cache_type_v
+static bool parse_kv_type(const std::string &name, ggml_type &out) {
+    static const std::pair<const char *, ggml_type> types[] = {
+        {"f32", GGML_TYPE_F32},   {"f16", GGML_TYPE_F16},   {"bf16", GGML_TYPE_BF16},
+        {"q8_0", GGML_TYPE_Q8_0}, {"q5_1", GGML_TYPE_Q5_1}, {"q5_0", GGML_TYPE_Q5_0},
+        {"q4_1", GGML_TYPE_Q4_1}, {"q4_0", GGML_TYPE_Q4_0},
+    };
+    for (const auto &t : types) {
+        if (name == t.first) {
+            out = t.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t row_bytes(ggml_type type, uint64_t n) {
+    return static_cast<size_t>(n / ggml_blck_size(type) * ggml_type_size(type));
+}
+
+// KV cache: K and V rows of every layer for every context cell
+static size_t kv_bytes(const GgufInfo &m, int n_ctx, ggml_type type_k, ggml_type type_v) {
+    return static_cast<size_t>(n_ctx) * (row_bytes(type_k, m.n_embd_k) + row_bytes(type_v, m.n_embd_v));
+}
+
+// Rough upper bound on llama.cpp's compute buffers for one ubatch of n_batch tokens:
+// logits, the f32 KQ scores over the whole context (not materialised with
+// flash attention), and FFN/residual activations
+static size_t compute_bytes(const GgufInfo &m, int n_ctx, int n_batch, bool flash_attn) {
+    const size_t nb = static_cast<size_t>(n_batch);
+    return nb * m.n_vocab * 4
+         + (flash_attn ? 0 : nb * static_cast<size_t>(n_ctx) * m.n_head * 4)
+         + nb * (3ull * m.n_ff + 8ull * m.n_embd) * 4;
+}
+
+static MemoryPlan plan_memory_impl(const PiVisionConfig &cfg) {
+    MemoryPlan plan;
+    GgufInfo llm, proj, draft;
+    if (!read_gguf_info(cfg.model_path, llm, true)) {
+        plan.error = "cannot read GGUF metadata from " + cfg.model_path;
+        return plan;
+    }
+    if (!cfg.vision_path.empty() && !read_gguf_info(cfg.vision_path, proj, false)) {
+        plan.error = "cannot read GGUF metadata from " + cfg.vision_path;
+        return plan;
+    }
+    const bool has_draft = !cfg.draft_model_path.empty();
+    if (has_draft && !read_gguf_info(cfg.draft_model_path, draft, true)) {
+        plan.error = "cannot read GGUF metadata from " + cfg.draft_model_path;
+        return plan;
+    }
+
+    plan.n_ctx_train = static_cast<int>(llm.n_ctx_train);
+    plan.weights_bytes = llm.tensor_bytes;
+    // Encoder activations for one image are in the order of a quarter of the projector
+    plan.projector_bytes = proj.tensor_bytes + proj.tensor_bytes / 4;
+    plan.margin_bytes = static_cast<size_t>(std::max(cfg.memory_margin_mb, 0)) << 20;
+    plan.available_bytes = mem_available_bytes();
+
+    ggml_type type_k = GGML_TYPE_F16, type_v = GGML_TYPE_F16;
+    parse_kv_type(cfg.cache_type_k, type_k);
+    parse_kv_type(cfg.cache_type_v, type_v);
+    const bool flash = cfg.flash_attn == "on";
+
+    auto estimate = [&](int n_ctx, int n_batch) {
+        // Compute buffers are sized for one physical batch
+        const int n_ubatch = cfg.n_ubatch > 0 ? std::min(cfg.n_ubatch, n_batch) : n_batch;
+        plan.n_ctx = n_ctx;
+        plan.n_batch = n_batch;
+        plan.kv_bytes = kv_bytes(llm, n_ctx, type_k, type_v);
+        plan.compute_bytes = compute_bytes(llm, n_ctx, n_ubatch, flash);
+        plan.draft_bytes = has_draft
+            ? draft.tensor_bytes + kv_bytes(draft, n_ctx, type_k, type_v) + compute_bytes(draft, n_ctx, n_ubatch, flash) : 0;
+        plan.total_bytes = plan.weights_bytes + plan.projector_bytes + plan.draft_bytes
+                         + plan.kv_bytes + plan.compute_bytes + plan.margin_bytes;
+        // Without /proc/meminfo there is nothing to check against
+        plan.fits = plan.available_bytes == 0 || plan.total_bytes <= plan.available_bytes;
+        return plan.fits;
+    };
+
+    if (!cfg.auto_n_ctx) {
+        estimate(cfg.n_ctx, cfg.n_batch);
+        return plan;
+    }
+
+    // Largest context, in 256-cell steps up to the training context, that fits
+    // with the configured batch; smaller batches only when even 512 cells do not
+    const int n_max = std::max(static_cast<int>(llm.n_ctx_train) / 256 * 256, 512);
+    for (int n_batch = cfg.n_batch; n_batch >= 64; n_batch /= 2)
+        for (int n_ctx = n_max; n_ctx >= 512; n_ctx -= 256)
+            if (estimate(n_ctx, std::min(n_batch, n_ctx)))
+                return plan;
+    estimate(512, 64);
+    return plan;
+}
+
+static std::string format_gb(size_t bytes) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.2f GB", bytes / (1024.0 * 1024.0 * 1024.0));
+    return buf;
+}
+
+static std::string format_2f(float v) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.2f", v);
+    return buf;
+}
+
+// Encoded image embeddings keyed by projector identity + image content.
+// Entries are kept in memory (oldest evicted first) and, when a cache
+// directory is configured, persisted as <key>.embd files that are mmap'd
+// back in on a later run instead of re-running the vision encoder.
+class EmbdCache {
+public:
+    struct Entry {
+        const float *data = nullptr;
+        size_t n_floats = 0;
+        double encode_ms = 0.0;   // what the encoder cost when this entry was made
+
+        std::vector<float> owned;
+        void *map = nullptr;
+        size_t map_len = 0;
+
+        ~Entry() {
+            if (map) munmap(map, map_len);
+        }
+    };
+
+    EmbdCache(size_t max_entries, std::string dir) : max_entries_(max_entries), dir_(std::move(dir)) {
+        if (!dir_.empty()) {
+            std::error_code ec;
+            std::filesystem::create_directories(dir_, ec);
+        }
+    }
+
+    bool enabled() const { return max_entries_ > 0 || !dir_.empty(); }
+
+    const Entry *find(const std::string &key, size_t n_floats) {
+        for (auto &e : entries_)
+            if (e.first == key && e.second->n_floats == n_floats)
+                return e.second.get();
+
+        if (dir_.empty()) return nullptr;
+        auto entry = map_file(key, n_floats);
+        if (!entry) return nullptr;
+        return insert(key, std::move(entry));
+    }
+
+    const Entry *store(const std::string &key, const float *embd, size_t n_floats, double encode_ms) {
+        auto entry = std::make_unique<Entry>();
+        entry->owned.assign(embd, embd + n_floats);
+        entry->data = entry->owned.data();
+        entry->n_floats = n_floats;
+        entry->encode_ms = encode_ms;
+
+        if (!dir_.empty())
+            write_file(key, *entry);
+
+        return insert(key, std::move(entry));
+    }
+
+private:
+    struct FileHeader {
+        char     magic[8];
+        uint64_t n_floats;
+        double   encode_ms;
+    };
+    static constexpr char MAGIC[8] = {'P', 'V', 'E', 'M', 'B', 'D', '1', '\0'};
+
+    size_t max_entries_;
+    std::string dir_;
+    std::vector<std::pair<std::string, std::unique_ptr<Entry>>> entries_;
+
+    std::string path_for(const std::string &key) const {
+        return (std::filesystem::path(dir_) / (key + ".embd")).string();
+    }
+
+    const Entry *insert(const std::string &key, std::unique_ptr<Entry> entry) {
+        const Entry *ptr = entry.get();
+        entries_.emplace_back(key, std::move(entry));
+        // Keep at least the entry just inserted; it is about to be decoded
+        while (entries_.size() > std::max<size_t>(max_entries_, 1))
+            entries_.erase(entries_.begin());
+        return ptr;
+    }
+
+    std::unique_ptr<Entry> map_file(const std::string &key, size_t n_floats) const {
+        const std::string path = path_for(key);
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return nullptr;
+
+        struct stat st {};
+        const size_t expected = sizeof(FileHeader) + n_floats * sizeof(float);
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) != expected) {
+            close(fd);
+            return nullptr;
+        }
+
+        void *map = mmap(nullptr, expected, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return nullptr;
+
+        FileHeader hdr;
+        std::memcpy(&hdr, map, sizeof(hdr));
+        if (std::memcmp(hdr.magic, MAGIC, sizeof(MAGIC)) != 0 || hdr.n_floats != n_floats) {
+            munmap(map, expected);
+            return nullptr;
+        }
+
+        auto entry = std::make_unique<Entry>();
+        entry->map = map;
+        entry->map_len = expected;
+        entry->data = reinterpret_cast<const float *>(static_cast<const char *>(map) + sizeof(FileHeader));
+        entry->n_floats = n_floats;
+        entry->encode_ms = hdr.encode_ms;
+        return entry;
+    }
+
+    void write_file(const std::string &key, const Entry &entry) const {
+        const std::string path = path_for(key);
+        // Processes and threads sharing the directory may store the same key at
+        // once, so each writer gets its own temp file
+        const std::string tmp = path + "." + std::to_string(getpid()) + "." +
+                                std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id())) + ".tmp";
+
+        FileHeader hdr;
+        std::memcpy(hdr.magic, MAGIC, sizeof(MAGIC));
+        hdr.n_floats = entry.n_floats;
+        hdr.encode_ms = entry.encode_ms;
+
+        std::ofstream f(tmp, std::ios::binary);
+        f.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+        f.write(reinterpret_cast<const char *>(entry.data), static_cast<std::streamsize>(entry.n_floats * sizeof(float)));
+        f.close();
+
+        // Rename so a concurrent reader never maps a half-written file
+        if (f) std::rename(tmp.c_str(), path.c_str());
+        else   std::remove(tmp.c_str());
+    }
+};
+
+// Parses a CPU list ("0-3,6") or hex mask ("0xf") into a cpu_set_t
+static bool parse_cpu_mask(const std::string &spec, cpu_set_t &set) {
+    CPU_ZERO(&set);
+    if (spec.rfind("0x", 0) == 0 || spec.rfind("0X", 0) == 0) {
+        int cpu = 0;
+        for (size_t i = spec.size(); i-- > 2; cpu += 4) {
+            const char c = spec[i];
+            int v;
+            if (c >= '0' && c <= '9')      v = c - '0';
+            else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+            else return false;
+            for (int b = 0; b < 4; ++b)
+                if ((v >> b) & 1 && cpu + b < CPU_SETSIZE) CPU_SET(cpu + b, &set);
+        }
+        return CPU_COUNT(&set) > 0;
+    }
+
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        int lo, hi;
+        char dash;
+        std::stringstream is(item);
+        if (!(is >> lo)) return false;
+        hi = lo;
+        if (is >> dash && (dash != '-' || !(is >> hi))) return false;
+        if (lo < 0 || hi < lo || hi >= CPU_SETSIZE) return false;
+        for (int c = lo; c <= hi; ++c) CPU_SET(c, &set);
+    }
+    return CPU_COUNT(&set) > 0;
+}
+
+// Restricts the calling thread to `mask` for its lifetime. ggml spawns its
+// compute workers from the calling thread, so they inherit the mask too.
+class AffinityScope {
+public:
+    explicit AffinityScope(const cpu_set_t *mask) {
+        if (mask && pthread_getaffinity_np(pthread_self(), sizeof(saved_), &saved_) == 0)
+            active_ = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), mask) == 0;
+    }
+    ~AffinityScope() {
+        if (active_) pthread_setaffinity_np(pthread_self(), sizeof(saved_), &saved_);
+    }
+
+    AffinityScope(const AffinityScope &) = delete;
+    AffinityScope &operator=(const AffinityScope &) = delete;
+
+private:
+    cpu_set_t saved_;
+    bool active_ = false;
+};
+
+// llama_backend_init() / llama_backend_free() are process-wide. Every
+// instance holds a reference, so instances that live side by side (e.g. in a
+// PiVisionPool) share one initialisation and only the last one frees it.
+class BackendRef {
+public:
+    BackendRef() {
+        std::lock_guard<std::mutex> lock(mutex());
+        if (refs()++ == 0) llama_backend_init();
+    }
+    ~BackendRef() {
+        std::lock_guard<std::mutex> lock(mutex());
+        if (--refs() == 0) llama_backend_free();
+    }
+
+    BackendRef(const BackendRef &) = delete;
+    BackendRef &operator=(const BackendRef &) = delete;
+
+private:
+    static std::mutex &mutex() {
+        static std::mutex m;
+        return m;
+    }
+    static int &refs() {
+        static int n = 0;
+        return n;
+    }
+};
+
+// Fixed set of worker threads running queued jobs in FIFO order. The
+// destructor finishes the queued jobs before joining.
+class WorkerPool {
+public:
+    explicit WorkerPool(size_t n_workers) {
+        for (size_t i = 0; i < n_workers; ++i)
+            workers_.emplace_back([this] { work(); });
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        for (auto &t : workers_) t.join();
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    template <typename F>
+    auto submit(F fn) -> std::future<decltype(fn())> {
+        auto task = std::make_shared<std::packaged_task<decltype(fn())()>>(std::move(fn));
+        std::future<decltype(fn())> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jobs_.emplace_back([task] { (*task)(); });
+        }
+        cv_.notify_one();
+        return result;
+    }
+
+private:
+    void work() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+                if (jobs_.empty()) return;
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> jobs_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+};
+
+// ---------- Image ingest ----------
+
+#if defined(__x86_64__) || defined(__i386__)
+// x86 builds target the baseline ISA, so the AVX2 loop is compiled for AVX2
+// on its own and chosen at run time. Returns the elements it handled.
+__attribute__((target("avx2")))
+static size_t accumulate_row_avx2(float *acc, const unsigned char *src, size_t n, float w) {
+    size_t i = 0;
+    const __m256 vw = _mm256_set1_ps(w);
+    for (; i + 8 <= n; i += 8) {
+        __m128i b = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + i));
+        __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(b));
+        _mm256_storeu_ps(acc + i, _mm256_add_ps(_mm256_loadu_ps(acc + i), _mm256_mul_ps(f, vw)));
+    }
+    return i;
+}
+#endif
+
+// acc[i] += w * src[i] over one RGB row, the inner loop of the resize
+static void accumulate_row(float *acc, const unsigned char *src, size_t n, float w) {
+    size_t i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool has_avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+    if (has_avx2)
+        i = accumulate_row_avx2(acc, src, n, w);
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t b = vld1q_u8(src + i);
+        uint16x8_t lo = vmovl_u8(vget_low_u8(b));
+        uint16x8_t hi = vmovl_u8(vget_high_u8(b));
+        vst1q_f32(acc + i,      vmlaq_n_f32(vld1q_f32(acc + i),      vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))),  w));
+        vst1q_f32(acc + i + 4,  vmlaq_n_f32(vld1q_f32(acc + i + 4),  vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo))), w));
+        vst1q_f32(acc + i + 8,  vmlaq_n_f32(vld1q_f32(acc + i + 8),  vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))),  w));
+        vst1q_f32(acc + i + 12, vmlaq_n_f32(vld1q_f32(acc + i + 12), vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi))), w));
+    }
+#endif
+    for (; i < n; ++i)
+        acc[i] += w * src[i];
+}
+
+// Box filter taps for shrinking n_in samples to n_out: output i is the
+// average of the input span [i * scale, (i + 1) * scale), with the samples
+// cut by either end weighted by how much of them is inside
+struct AreaTaps {
+    int first = 0;
+    std::vector<float> w;
+};
+
+static std::vector<AreaTaps> area_taps(int n_in, int n_out) {
+    std::vector<AreaTaps> taps(static_cast<size_t>(n_out));
+    const double scale = static_cast<double>(n_in) / n_out;
+    for (int i = 0; i < n_out; ++i) {
+        const double x0 = i * scale;
+        const double x1 = std::min((i + 1) * scale, static_cast<double>(n_in));
+        AreaTaps &t = taps[static_cast<size_t>(i)];
+        t.first = static_cast<int>(x0);
+        for (int j = t.first; j < x1; ++j)
+            t.w.push_back(static_cast<float>((std::min(x1, j + 1.0) - std::max(x0, static_cast<double>(j))) / scale));
+    }
+    return taps;
+}
+
+// Area-averaging downscale of packed RGB, one output row at a time: the
+// source rows it covers are summed into a float row (vectorised), which is
+// then reduced horizontally. Source rows are `stride` bytes apart; needs
+// w * 3 floats of scratch.
+static void resize_rgb(const unsigned char *src, int w, int h, size_t stride, unsigned char *dst, int ow, int oh) {
+    const std::vector<AreaTaps> xt = area_taps(w, ow);
+    const std::vector<AreaTaps> yt = area_taps(h, oh);
+    const size_t row = static_cast<size_t>(w) * 3;
+    std::vector<float> acc(row);
+
+    for (int y = 0; y < oh; ++y) {
+        const AreaTaps &ty = yt[static_cast<size_t>(y)];
+        std::fill(acc.begin(), acc.end(), 0.0f);
+        for (size_t k = 0; k < ty.w.size(); ++k)
+            accumulate_row(acc.data(), src + (ty.first + k) * stride, row, ty.w[k]);
+
+        unsigned char *out = dst + static_cast<size_t>(y) * ow * 3;
+        for (int x = 0; x < ow; ++x) {
+            const AreaTaps &tx = xt[static_cast<size_t>(x)];
+            const float *p = acc.data() + static_cast<size_t>(tx.first) * 3;
+            float rgb[3] = {0.0f, 0.0f, 0.0f};
+            for (float wk : tx.w) {
+                rgb[0] += wk * p[0];
+                rgb[1] += wk * p[1];
+                rgb[2] += wk * p[2];
+                p += 3;
+            }
+            for (int c = 0; c < 3; ++c)
+                out[x * 3 + c] = static_cast<unsigned char>(std::min(rgb[c] + 0.5f, 255.0f));
+        }
+    }
+}
+
+// An image file decoded to a bitmap on a worker thread
+struct DecodedImage {
+    mtmd::bitmap_ptr bitmap;
+    double decode_ms = 0.0;
+    double resize_ms = 0.0;
+    size_t peak_bytes = 0;  // decoded frame + resize scratch + what is passed on
+};
+
+// An image queued by load_image_async(), collected when the prompt is tokenized
+struct PendingImage {
+    std::string path;
+    std::future<DecodedImage> future;
+    DecodedImage done;
+
+    DecodedImage &wait() {
+        if (future.valid()) done = future.get();
+        return done;
+    }
+};
+
+// Length of the shared prefix of two token sequences; unknown tokens never match
+static size_t common_prefix(const std::vector<llama_token> &a, const std::vector<llama_token> &b) {
+    const size_t n = std::min(a.size(), b.size());
+    size_t i = 0;
+    while (i < n && a[i] == b[i] && a[i] != LLAMA_TOKEN_NULL)
+        ++i;
+    return i;
+}
+
+// One tokenized piece of a prompt: plain text tokens, or an image chunk whose
+// positions carry its pseudo token
+struct PromptChunk {
+    const mtmd_input_chunk *image = nullptr;
+    std::vector<llama_token> tokens;
+};
+
+// GBNF for a request: its grammar, or its JSON schema converted by llama.cpp's
+// common helper; empty when the reply is unconstrained
+static std::string request_grammar(const GenerationParams &gen) {
+    if (!gen.grammar.empty() && !gen.json_schema.empty())
+        throw std::runtime_error("pivision: grammar and json_schema cannot be combined");
+    if (gen.json_schema.empty())
+        return gen.grammar;
+    try {
+        return json_schema_to_grammar(nlohmann::ordered_json::parse(gen.json_schema));
+    } catch (const std::exception &e) {
+        throw std::runtime_error(std::string("pivision: invalid json_schema: ") + e.what());
+    }
+}
+
+// When a request with this budget started at `start` has to end
+static std::chrono::steady_clock::time_point request_deadline(const GenerationParams &gen,
+                                                              std::chrono::steady_clock::time_point start) {
+    namespace chr = std::chrono;
+    if (gen.max_wall_ms <= 0) return chr::steady_clock::time_point::max();
+    return start + chr::milliseconds(gen.max_wall_ms);
+}
+
+// Offset of the earliest stop string in `text`, looking only where a match
+// could include the last n_new bytes; npos if there is none
+static size_t find_stop(const std::string &text, size_t n_new, const std::vector<std::string> &stop) {
+    size_t best = std::string::npos;
+    for (const auto &s : stop) {
+        if (s.empty()) continue;
+        const size_t from = text.size() - std::min(text.size(), n_new + s.size() - 1);
+        best = std::min(best, text.find(s, from));
+    }
+    return best;
+}
+
+// Length of the longest tail of `text` that a stop string starts with
+static size_t stop_prefix_len(const std::string &text, const std::vector<std::string> &stop) {
+    size_t best = 0;
+    for (const auto &s : stop) {
+        if (s.empty()) continue;
+        for (size_t n = std::min(s.size() - 1, text.size()); n > best; --n)
+            if (text.compare(text.size() - n, n, s, 0, n) == 0) {
+                best = n;
+                break;
+            }
+    }
+    return best;
+}
+
+// KV cells of a named prompt head kept in their own sequence
+struct PinnedPrefix {
+    std::string name;
+    llama_seq_id seq_id;
+    std::vector<llama_token> tokens;
+};
+
+// Per-request timings and counters, kept by the engine rather than llama_perf
+struct RunCounters {
+    int    prompt_tokens        = 0;  // decoded this request
+    int    prompt_tokens_reused = 0;  // served from the KV cache
+    double prompt_ms            = 0.0;
+    int    gen_tokens           = 0;
+    double gen_ms               = 0.0;
+    int    embd_cache_hits     = 0;
+    int    embd_cache_misses   = 0;
+    double embd_cache_saved_ms = 0.0;
+    int    tokens_evicted      = 0;
+    std::vector<double> image_decode_ms;
+    std::vector<double> image_resize_ms;
+    size_t image_peak_bytes    = 0;
+    double image_wait_ms       = 0.0;
+    int    draft_tokens        = 0;  // proposed by the draft model
+    int    draft_accepted      = 0;
+    double draft_ms            = 0.0;
+    double tokenize_ms         = 0.0;  // prompt tokenization incl. image preprocessing
+    double encode_ms           = 0.0;  // vision encoder
+    double image_embd_ms       = 0.0;  // image embeddings decoded into the KV cache
+    double prefill_ms          = 0.0;  // text prompt decode
+    double sample_ms           = 0.0;
+    double detok_ms            = 0.0;
+    std::vector<ThermalSample> thermal_trace;
+    double thermal_pause_ms    = 0.0;
+    float  temp_max_c          = NAN;
+    double ttft_ms             = 0.0;  // request start to the first piece
+    double last_piece_ms       = 0.0;  // request start to the latest piece
+    int    n_pieces            = 0;
+    size_t n_streamed          = 0;    // bytes of the reply passed to the stream
+    std::string stop_reason;
+};
+
+// KV positions [p0, p1) of one completed chat turn (user message + reply)
+struct TurnSpan {
+    llama_pos p0;
+    llama_pos p1;
+};
+
+// A run_batch() request occupying its own sequence
+struct BatchSlot {
+    size_t index = 0;  // position in the request list
+    llama_seq_id seq_id = -1;
+    llama_sampler *sampler = nullptr;
+    llama_sampler *grammar = nullptr;  // the request's grammar, if constrained
+
+    mtmd::input_chunks chunks{mtmd_input_chunks_init()};
+    std::vector<PromptChunk> prompt;
+    int n_prompt = 0;
+    size_t chunk = 0;   // prefill cursor: next chunk, and offset into its tokens
+    size_t offset = 0;
+    llama_pos pos = 0;  // next position in the sequence
+    int n_prefill = 0;  // prompt tokens in the current batch
+
+    int max_tokens = 0;
+    bool clipped = false;  // max_tokens shortened to what the context holds
+    std::chrono::steady_clock::time_point deadline;
+    std::vector<std::string> stop;
+    std::string stop_reason;
+    int reserved = 0;   // KV cells set aside on admission
+    int i_batch = -1;   // logits row in the current batch, if any
+    llama_token pending = LLAMA_TOKEN_NULL;  // sampled but not yet decoded
+    int n_gen = 0;
+    std::string content;
+    bool done = false;
+    bool failed = false;
+
+    RunCounters counters;
+    std::chrono::steady_clock::time_point admitted;
+    std::chrono::steady_clock::time_point first_token;
+
+    BatchSlot() = default;
+    BatchSlot(const BatchSlot &) = delete;
+    BatchSlot &operator=(const BatchSlot &) = delete;
+    ~BatchSlot() {
+        if (sampler) llama_sampler_free(sampler);
+        if (grammar) llama_sampler_free(grammar);
+    }
+};
+
 struct PiVision::Impl {
+    // First member, so the backend outlives everything below and is released
+    // even when the constructor throws
+    BackendRef backend;
     PiVisionConfig config;
 
     llama_model *model = nullptr;
@@ -68,29 +889,157 @@ struct PiVision::Impl {
     const llama_vocab *vocab = nullptr;
     mtmd_context *mtmd_ctx = nullptr;
     llama_sampler *sampler = nullptr;
-
-    std::vector<mtmd::bitmap> bitmaps;
+    llama_batch batch = {};
+
+    // Optional draft model for speculative decoding
+    llama_model *draft_model = nullptr;
+    llama_context *draft_ctx = nullptr;
+    llama_sampler *draft_sampler = nullptr;
+    llama_batch draft_batch = {};
+    std::vector<llama_token> draft_kv;  // token at every position of the draft's seq 0
+
+    // The request being generated: its limits, and a grammar sampler when it
+    // is constrained
+    GenerationParams gen;
+    std::chrono::steady_clock::time_point deadline;
+    llama_sampler *grammar = nullptr;
+    std::vector<llama_token_data> candidates;  // full-vocabulary resampling under the grammar
+
+    // Cancellation. Every request gets an id when it is issued (a run_async()
+    // one when its handle is made) and PiVision::cancel() marks the active id,
+    // from any thread or a signal handler. Ids only grow, so a cancel never
+    // carries over to a later request. A run_async() request also watches its
+    // handle's own token.
+    std::atomic<uint32_t> next_request{0};
+    std::atomic<uint32_t> active_request{0};
+    std::atomic<uint32_t> cancelled_request{0};
+    uint32_t request_id = 0;  // the request being run
+    const std::atomic<bool> *handle_cancel = nullptr;
+
+    // The configuration is deterministic and has no penalty: tokens are the
+    // argmax of the logits and the sampler chain is not run
+    bool greedy = false;
+    std::string sampler_desc;  // for RunResult::sampler
+
+    int image_side = 0;  // shorter side large images are shrunk to on decode; 0 = keep
+
+    std::vector<PendingImage> images;
+    std::unique_ptr<WorkerPool> decode_pool;
     std::string model_desc;
     std::string chat_template;
 
     common_chat_templates_ptr tmpls;
     std::vector<common_chat_msg> chat_history;
+    std::vector<TurnSpan> turns;  // one per user/assistant pair in chat_history
+    llama_pos turn_p0 = 0;        // start of the turn being generated
 
     llama_pos n_past = 0;
 
+    std::unique_ptr<EmbdCache> embd_cache;
+    std::string projector_id;
+    RunCounters counters;
+
+    // Token (or image pseudo token) at every position of seq 0, for prefix reuse
+    std::vector<llama_token> kv_tokens;
+    // Pseudo token of every image id seen by this instance; each id gets its own
+    // value, so two images only match when their ids are equal
+    std::unordered_map<std::string, llama_token> image_tokens;
+    llama_token next_image_token = -2;
+    std::vector<PinnedPrefix> pins;
+    bool mrope = false;  // M-RoPE images do not map one token to one position
+
+    double load_ms = 0.0;
+    LoadTimings load_timings;
+    MemoryPlan plan;
+
+    bool has_cpu_mask = false;
+    cpu_set_t cpu_mask;
+    int n_threads_vision = 0;  // effective encoder threads
+    bool load_reported = false;
+    std::chrono::steady_clock::time_point request_start;  // TokenEvent time base
+
+    // Thermal governor state; throttling carries over between requests
+    bool thermal_on = false;
+    int thermal_base_threads = 0;  // generation threads when cool
+    double thermal_pace_ms = 0.0;  // sleep after every generated token
+    std::chrono::steady_clock::time_point thermal_last;
+
     explicit Impl(const PiVisionConfig &cfg) : config(cfg) {
+        namespace chr = std::chrono;
+        auto load_start = chr::steady_clock::now();
+        // Time since the previous lap, for the startup breakdown
+        auto lap_start = load_start;
+        auto lap = [&lap_start] {
+            auto now = chr::steady_clock::now();
+            double ms = chr::duration<double, std::milli>(now - lap_start).count();
+            lap_start = now;
+            return ms;
+        };
+
+        if (!config.cpu_mask.empty()) {
+            if (!parse_cpu_mask(config.cpu_mask, cpu_mask))
+                throw std::runtime_error("pivision: invalid cpu mask: " + config.cpu_mask);
+            has_cpu_mask = true;
+        }
+        AffinityScope pin(affinity());
+
+        // Workers start under the affinity above and keep it
+        const unsigned n_cpu = std::max(1u, std::thread::hardware_concurrency());
+        decode_pool = std::make_unique<WorkerPool>(std::min(n_cpu, 4u));
+
         // Suppress llama.cpp and vision encoder log spam globally
         llama_log_set(quiet_log_callback, nullptr);
         mtmd_helper_log_set(quiet_log_callback, nullptr);
 
-        llama_backend_init();
+        ggml_type type_k, type_v;
+        if (!parse_kv_type(config.cache_type_k, type_k))
+            throw std::runtime_error("pivision: unknown KV cache type: " + config.cache_type_k);
+        if (!parse_kv_type(config.cache_type_v, type_v))
+            throw std::runtime_error("pivision: unknown KV cache type: " + config.cache_type_v);
+        if (config.flash_attn != "auto" && config.flash_attn != "on" && config.flash_attn != "off")
+            throw std::runtime_error("pivision: flash_attn must be auto, on or off: " + config.flash_attn);
+        // llama.cpp only reads a quantized V cache through the flash attention kernel
+        if (type_v != GGML_TYPE_F16 && type_v != GGML_TYPE_F32 && type_v != GGML_TYPE_BF16 && config.flash_attn == "off")
+            throw std::runtime_error("pivision: a quantized V cache (" + config.cache_type_v + ") needs flash_attn");
+
+        // Also gives the KV footprint reported with every result
+        plan = plan_memory_impl(config);
+        if (config.check_memory || config.auto_n_ctx) {
+            if (!plan.error.empty()) {
+                fprintf(stderr, "[pivision] memory check skipped: %s\n", plan.error.c_str());
+            } else {
+                if (config.auto_n_ctx) {
+                    config.n_ctx = plan.n_ctx;
+                    config.n_batch = plan.n_batch;
+                }
+                if (!plan.fits)
+                    throw std::runtime_error(
+                        "pivision: estimated peak memory " + format_gb(plan.total_bytes) + " at n_ctx " +
+                        std::to_string(plan.n_ctx) + " (weights " + format_gb(plan.weights_bytes) +
+                        ", projector " + format_gb(plan.projector_bytes) + ", KV " + format_gb(plan.kv_bytes) +
+                        ", compute " + format_gb(plan.compute_bytes) +
+                        (plan.draft_bytes ? ", draft " + format_gb(plan.draft_bytes) : std::string()) +
+                        ") exceeds available " + format_gb(plan.available_bytes) +
+                        (config.auto_n_ctx ? std::string() : "; lower n_ctx or enable auto_n_ctx"));
+            }
+        }
+
+        if (config.prefetch) {
+            prefetch_file(config.model_path);
+            if (!config.vision_path.empty()) prefetch_file(config.vision_path);
+            if (!config.draft_model_path.empty()) prefetch_file(config.draft_model_path);
+        }
+        load_timings.prefetch_ms = lap();
 
         llama_model_params mparams = llama_model_default_params();
         mparams.n_gpu_layers = 0;
+        mparams.use_mmap = config.use_mmap;
+        mparams.use_mlock = config.use_mlock;
 
         model = llama_model_load_from_file(config.model_path.c_str(), mparams);
         if (!model)
             throw std::runtime_error("pivision: failed to load LLM from " + config.model_path);
+        load_timings.model_ms = lap();
 
         vocab = llama_model_get_vocab(model);
 
@@ -103,46 +1052,187 @@ struct PiVision::Impl {
             chat_template = tmpl;
 
         tmpls = common_chat_templates_init(model, "");
+        load_timings.template_ms = lap();
 
         llama_context_params cparams = llama_context_default_params();
+        if (config.context_policy != "sliding_window" && config.context_policy != "none")
+            throw std::runtime_error("pivision: unknown context policy: " + config.context_policy);
+
         cparams.n_ctx = static_cast<uint32_t>(config.n_ctx);
-        cparams.n_batch = 512;
-        cparams.n_ubatch = 512;
+        cparams.n_batch = static_cast<uint32_t>(config.n_batch);
+        cparams.n_ubatch = static_cast<uint32_t>(config.n_ubatch > 0 ? std::min(config.n_ubatch, config.n_batch)
+                                                                      : config.n_batch);
         cparams.no_perf = false;
+        // seq 0 serves requests, seqs 1..N hold pinned prompt prefixes in the same
+        // cells, and the seqs after them carry run_batch() requests
+        cparams.n_seq_max = 1 + static_cast<uint32_t>(std::max(config.max_pinned_prefixes, 0))
+                              + static_cast<uint32_t>(std::max(config.n_parallel, 1));
+        cparams.kv_unified = true;
+        cparams.type_k = type_k;
+        cparams.type_v = type_v;
+        cparams.flash_attn_type = config.flash_attn == "on"  ? LLAMA_FLASH_ATTN_TYPE_ENABLED
+                                : config.flash_attn == "off" ? LLAMA_FLASH_ATTN_TYPE_DISABLED
+                                                             : LLAMA_FLASH_ATTN_TYPE_AUTO;
+
+        // Unset thread counts follow the cpu mask, or llama.cpp's defaults without one
+        const int n_mask = has_cpu_mask ? CPU_COUNT(&cpu_mask) : 0;
+        if (config.n_threads > 0)            cparams.n_threads = config.n_threads;
+        else if (n_mask > 0)                 cparams.n_threads = n_mask;
+        if (config.n_threads_batch > 0)      cparams.n_threads_batch = config.n_threads_batch;
+        else if (config.n_threads > 0)       cparams.n_threads_batch = config.n_threads;
+        else if (n_mask > 0)                 cparams.n_threads_batch = n_mask;
 
         ctx = llama_init_from_model(model, cparams);
         if (!ctx)
             throw std::runtime_error("pivision: failed to create llama context");
 
+        batch = llama_batch_init(static_cast<int32_t>(llama_n_batch(ctx)), 0, 1);
+        load_timings.context_ms = lap();
+
         if (!config.vision_path.empty()) {
             mtmd_context_params mp = mtmd_context_params_default();
             mp.use_gpu = false;
-            mp.n_threads = 4;
+            mp.n_threads = config.n_threads_vision > 0 ? config.n_threads_vision : cparams.n_threads_batch;
+            n_threads_vision = mp.n_threads;
             mp.print_timings = false;
 
             mtmd_ctx = mtmd_init_from_file(config.vision_path.c_str(), model, mp);
             if (!mtmd_ctx)
                 throw std::runtime_error("pivision: failed to load vision projector from " + config.vision_path);
+
+            projector_id = projector_identity(config.vision_path);
+            image_side = config.image_resize > 0 ? config.image_resize
+                       : config.image_resize == 0 ? projector_image_side(config.vision_path) : 0;
+            mrope = mtmd_decode_use_mrope(mtmd_ctx);
         }
+        load_timings.projector_ms = lap();
+
+        if (!config.draft_model_path.empty())
+            load_draft_model(mparams, cparams);
+        load_timings.draft_ms = lap();
+
+        embd_cache = std::make_unique<EmbdCache>(static_cast<size_t>(std::max(config.embd_cache_entries, 0)),
+                                                 config.embd_cache_dir);
 
         build_sampler();
+
+        if (config.thermal_governor) {
+            thermal_on = !std::isnan(read_temp_c(config.thermal_zone));
+            if (!thermal_on)
+                fprintf(stderr, "[pivision] cannot read %s, thermal governor disabled\n", config.thermal_zone.c_str());
+            thermal_base_threads = llama_n_threads(ctx);
+        }
+
+        if (config.warmup) {
+            warmup_decode(ctx);
+            if (draft_ctx) warmup_decode(draft_ctx);
+        }
+        load_timings.warmup_ms = lap();
+
+        load_ms = chr::duration<double, std::milli>(chr::steady_clock::now() - load_start).count();
+        load_timings.total_ms = load_ms;
+        load_timings.use_mmap = config.use_mmap;
+        load_timings.use_mlock = config.use_mlock;
+    }
+
+    // One throwaway decode so weight pages are faulted in and the compute
+    // buffers are allocated before the first request; leaves the KV cache empty
+    static void warmup_decode(llama_context *c) {
+        const llama_vocab *v = llama_model_get_vocab(llama_get_model(c));
+        llama_token tok = llama_vocab_bos(v);
+        if (tok == LLAMA_TOKEN_NULL) tok = llama_vocab_eos(v);
+        if (tok == LLAMA_TOKEN_NULL) tok = 0;
+        llama_decode(c, llama_batch_get_one(&tok, 1));
+        llama_synchronize(c);
+        llama_memory_clear(llama_get_memory(c), true);
+        llama_perf_context_reset(c);
     }
 
     ~Impl() {
+        // Queued decodes still use mtmd_ctx
+        decode_pool.reset();
         if (sampler) llama_sampler_free(sampler);
+        if (grammar) llama_sampler_free(grammar);
+        if (batch.token) llama_batch_free(batch);
+        if (draft_sampler) llama_sampler_free(draft_sampler);
+        if (draft_batch.token) llama_batch_free(draft_batch);
+        if (draft_ctx) llama_free(draft_ctx);
+        if (draft_model) llama_model_free(draft_model);
         if (mtmd_ctx) mtmd_free(mtmd_ctx);
         if (ctx) llama_free(ctx);
         if (model) llama_model_free(model);
-        llama_backend_free();
     }
 
+    void load_draft_model(const llama_model_params &mparams, llama_context_params cparams) {
+        draft_model = llama_model_load_from_file(config.draft_model_path.c_str(), mparams);
+        if (!draft_model)
+            throw std::runtime_error("pivision: failed to load draft model from " + config.draft_model_path);
+
+        // Proposals are compared token id for token id, so the vocabularies must agree
+        const llama_vocab *dv = llama_model_get_vocab(draft_model);
+        if (llama_vocab_type(dv) != llama_vocab_type(vocab) ||
+            llama_vocab_n_tokens(dv) != llama_vocab_n_tokens(vocab) ||
+            llama_vocab_bos(dv) != llama_vocab_bos(vocab) ||
+            llama_vocab_eos(dv) != llama_vocab_eos(vocab))
+            throw std::runtime_error("pivision: draft model vocabulary does not match " + config.model_path);
+
+        cparams.n_seq_max = 1;
+        draft_ctx = llama_init_from_model(draft_model, cparams);
+        if (!draft_ctx)
+            throw std::runtime_error("pivision: failed to create draft context");
+
+        draft_batch = llama_batch_init(static_cast<int32_t>(llama_n_batch(draft_ctx)), 0, 1);
+        draft_sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
+        llama_sampler_chain_add(draft_sampler, llama_sampler_init_greedy());
+    }
+
+    // Filters that cannot change the outcome are left out of the chain. A
+    // deterministic configuration ends in a greedy pick, and without a penalty
+    // the chain is bypassed entirely (see sample_token())
     void build_sampler() {
         auto sparams = llama_sampler_chain_default_params();
         sampler = llama_sampler_chain_init(sparams);
-        llama_sampler_chain_add(sampler, llama_sampler_init_top_k(40));
-        llama_sampler_chain_add(sampler, llama_sampler_init_top_p(0.95f, 1));
-        llama_sampler_chain_add(sampler, llama_sampler_init_temp(config.temperature));
-        llama_sampler_chain_add(sampler, llama_sampler_init_dist(42));
+        std::vector<std::string> desc;
+
+        if (config.repeat_penalty != 1.0f) {
+            llama_sampler_chain_add(sampler, llama_sampler_init_penalties(config.repeat_last_n, config.repeat_penalty, 0.0f, 0.0f));
+            desc.push_back("penalty " + format_2f(config.repeat_penalty) + "/" + std::to_string(config.repeat_last_n));
+        }
+        if (config.temperature <= 0.0f || config.top_k == 1) {
+            llama_sampler_chain_add(sampler, llama_sampler_init_greedy());
+            greedy = desc.empty();
+            desc.push_back("greedy");
+        } else {
+            if (config.top_k > 0) {
+                llama_sampler_chain_add(sampler, llama_sampler_init_top_k(config.top_k));
+                desc.push_back("top_k " + std::to_string(config.top_k));
+            }
+            if (config.top_p < 1.0f) {
+                llama_sampler_chain_add(sampler, llama_sampler_init_top_p(config.top_p, 1));
+                desc.push_back("top_p " + format_2f(config.top_p));
+            }
+            if (config.min_p > 0.0f) {
+                llama_sampler_chain_add(sampler, llama_sampler_init_min_p(config.min_p, 1));
+                desc.push_back("min_p " + format_2f(config.min_p));
+            }
+            llama_sampler_chain_add(sampler, llama_sampler_init_temp(config.temperature));
+            llama_sampler_chain_add(sampler, llama_sampler_init_dist(config.seed < 0 ? LLAMA_DEFAULT_SEED
+                                                                                     : static_cast<uint32_t>(config.seed)));
+            desc.push_back("temp " + format_2f(config.temperature));
+            desc.push_back(config.seed < 0 ? std::string("seed random") : "seed " + std::to_string(config.seed));
+        }
+
+        sampler_desc.clear();
+        for (const auto &d : desc)
+            sampler_desc += (sampler_desc.empty() ? "" : " > ") + d;
+    }
+
+    // Greedy pick over the raw logits of batch row idx: no candidate array,
+    // sort or softmax
+    llama_token argmax(int32_t idx) const {
+        const float *logits = llama_get_logits_ith(ctx, idx);
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+        return static_cast<llama_token>(std::max_element(logits, logits + n_vocab) - logits);
     }
 
     std::string validate(const std::vector<std::string> &paths) const {
@@ -152,155 +1242,933 @@ struct PiVision::Impl {
         if (!mtmd_support_vision(mtmd_ctx))
             return "vision projector does not support vision input – is it compatible with this LLM?";
 
+        // One open per file: it must exist and start like a JPEG or PNG
         for (const auto &p : paths) {
-            std::ifstream f(p);
-            if (!f.good())
+            std::ifstream f(p, std::ios::binary);
+            if (!f)
                 return "image file not found: " + p;
-            if (!is_valid_image_format(p))
+            unsigned char hdr[4] = {};
+            f.read(reinterpret_cast<char *>(hdr), sizeof(hdr));
+            if (!is_image_header(hdr, static_cast<size_t>(f.gcount())))
                 return "unsupported image format (expected JPG or PNG): " + p;
         }
         return {};
     }
 
-    bool load_image(const std::string &path) {
-        mtmd_bitmap *bmp = mtmd_helper_bitmap_init_from_file(mtmd_ctx, path.c_str());
-        if (!bmp) {
-            fprintf(stderr, "[pivision] failed to load image: %s\n", path.c_str());
+    // Checks the header and decodes encoded JPEG/PNG bytes to packed RGB;
+    // nullptr when they are not an image stb can decode
+    static unsigned char *decode_rgb(const unsigned char *data, size_t size, int &w, int &h) {
+        if (!is_image_header(data, size) || size > static_cast<size_t>(INT_MAX)) return nullptr;
+        int n_channels = 0;
+        return stbi_load_from_memory(data, static_cast<int>(size), &w, &h, &n_channels, 3);
+    }
+
+    // Builds the bitmap from RGB rows `stride` bytes apart. Frames whose
+    // shorter side exceeds `side` (when > 0) are shrunk straight from `pixels`
+    // first, so only the small copy travels on to the projector's
+    // preprocessing. `held` is what the caller keeps alive meanwhile, for
+    // peak_bytes.
+    static void ingest_pixels(const unsigned char *pixels, int w, int h, size_t stride, int side, size_t held,
+                              DecodedImage &out) {
+        namespace chr = std::chrono;
+        auto t0 = chr::steady_clock::now();
+        std::vector<unsigned char> packed;
+        size_t scratch = 0;
+        if (side > 0 && std::min(w, h) > side) {
+            const double scale = static_cast<double>(side) / std::min(w, h);
+            const int ow = std::max(1, static_cast<int>(std::lround(w * scale)));
+            const int oh = std::max(1, static_cast<int>(std::lround(h * scale)));
+            packed.resize(static_cast<size_t>(ow) * oh * 3);
+            resize_rgb(pixels, w, h, stride, packed.data(), ow, oh);
+            scratch = static_cast<size_t>(w) * 3 * sizeof(float);
+            w = ow;
+            h = oh;
+            out.resize_ms = chr::duration<double, std::milli>(chr::steady_clock::now() - t0).count();
+        } else if (stride != static_cast<size_t>(w) * 3) {
+            // mtmd_bitmap_init() takes packed rows
+            packed.resize(static_cast<size_t>(w) * h * 3);
+            for (int y = 0; y < h; ++y)
+                std::memcpy(packed.data() + static_cast<size_t>(y) * w * 3, pixels + y * stride, static_cast<size_t>(w) * 3);
+        }
+
+        // mtmd_bitmap_init() copies the pixels
+        out.bitmap.reset(mtmd_bitmap_init(static_cast<uint32_t>(w), static_cast<uint32_t>(h),
+                                          packed.empty() ? pixels : packed.data()));
+        const size_t bitmap_bytes = static_cast<size_t>(w) * h * 3;
+        out.peak_bytes = std::max(out.peak_bytes, held + packed.size() + std::max(scratch, bitmap_bytes));
+
+        if (mtmd_bitmap *bmp = out.bitmap.get()) {
+            // Content hash doubles as the embedding cache key for this image
+            uint64_t seed = (static_cast<uint64_t>(mtmd_bitmap_get_nx(bmp)) << 32) | mtmd_bitmap_get_ny(bmp);
+            uint64_t hash = hash_bytes(mtmd_bitmap_get_data(bmp), mtmd_bitmap_get_n_bytes(bmp), seed);
+            mtmd_bitmap_set_id(bmp, hex64(hash).c_str());
+        }
+    }
+
+    // Runs on a decode worker; an empty bitmap means the file could not be
+    // decoded. The file is read once and its header checked in the same
+    // buffer that is decoded; the encoded bytes are dropped before the resize.
+    static DecodedImage decode_image(const std::string &path, int side) {
+        auto t0 = std::chrono::steady_clock::now();
+        DecodedImage out;
+        std::vector<unsigned char> bytes;
+        std::ifstream f(path, std::ios::binary);
+        if (f)
+            bytes.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+
+        int w = 0, h = 0;
+        unsigned char *pixels = decode_rgb(bytes.data(), bytes.size(), w, h);
+        out.decode_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        if (!pixels) return out;
+
+        const size_t full_bytes = static_cast<size_t>(w) * h * 3;
+        out.peak_bytes = bytes.size() + full_bytes;
+        std::vector<unsigned char>().swap(bytes);
+        ingest_pixels(pixels, w, h, static_cast<size_t>(w) * 3, side, full_bytes, out);
+        stbi_image_free(pixels);
+        return out;
+    }
+
+    // Images passed as memory are ingested on the calling thread, so the
+    // caller's buffer is only read during the call
+    bool load_image_buffer(const unsigned char *data, size_t size) {
+        auto t0 = std::chrono::steady_clock::now();
+        DecodedImage d;
+        int w = 0, h = 0;
+        unsigned char *pixels = data ? decode_rgb(data, size, w, h) : nullptr;
+        d.decode_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        if (pixels) {
+            const size_t full_bytes = static_cast<size_t>(w) * h * 3;
+            ingest_pixels(pixels, w, h, static_cast<size_t>(w) * 3, image_side, full_bytes, d);
+            stbi_image_free(pixels);
+        }
+        return add_decoded("<buffer>", std::move(d));
+    }
+
+    bool load_image_rgb(const unsigned char *rgb, int width, int height, int stride) {
+        DecodedImage d;
+        const size_t row = stride > 0 ? static_cast<size_t>(stride) : static_cast<size_t>(width) * 3;
+        if (rgb && width > 0 && height > 0 && row >= static_cast<size_t>(width) * 3)
+            ingest_pixels(rgb, width, height, row, image_side, 0, d);
+        return add_decoded("<rgb frame>", std::move(d));
+    }
+
+    bool add_decoded(const std::string &name, DecodedImage d) {
+        if (!d.bitmap) {
+            fprintf(stderr, "[pivision] failed to load image: %s\n", name.c_str());
             return false;
         }
-        bitmaps.emplace_back(bmp);
+        images.push_back({name, {}, std::move(d)});
         return true;
     }
 
-    // Tokenize and eval a formatted prompt. Pass add_bos=true for the first turn
-    void eval_prompt(const std::string &formatted, bool add_bos) {
-        const int n_images = static_cast<int>(bitmaps.size());
-
-        if (n_images > 0 && mtmd_ctx) {
-            mtmd_input_text text;
-            text.text = formatted.c_str();
-            text.add_special = add_bos;
-            text.parse_special = true;
+    PendingImage queue_decode(const std::string &path) {
+        const int side = image_side;
+        return {path, decode_pool->submit([path, side] { return decode_image(path, side); }), {}};
+    }
 
-            mtmd::input_chunks chunks(mtmd_input_chunks_init());
+    void load_image_async(const std::string &path) {
+        images.push_back(queue_decode(path));
+    }
 
-            std::vector<const mtmd_bitmap *> bmp_ptrs;
-            bmp_ptrs.reserve(bitmaps.size());
-            for (auto &b : bitmaps)
-                bmp_ptrs.push_back(b.ptr.get());
+    bool load_image(const std::string &path) {
+        load_image_async(path);
+        if (!images.back().wait().bitmap) {
+            fprintf(stderr, "[pivision] failed to load image: %s\n", path.c_str());
+            images.pop_back();
+            return false;
+        }
+        return true;
+    }
 
-            int32_t tok_res = mtmd_tokenize(mtmd_ctx, chunks.ptr.get(), &text, bmp_ptrs.data(), bmp_ptrs.size());
-            if (tok_res != 0)
-                throw std::runtime_error("pivision: mtmd_tokenize failed (code " + std::to_string(tok_res) + ")");
+    void clear_images() {
+        images.clear();
+    }
 
-            bitmaps.clear();
+    // Waits for every queued image, in load order. Time spent blocked here is
+    // the part of the decode that did not overlap with other work.
+    std::vector<mtmd::bitmap_ptr> collect_images() {
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<PendingImage> pending = std::move(images);
+        images.clear();
+
+        std::vector<mtmd::bitmap_ptr> bitmaps;
+        std::string failed;
+        for (auto &img : pending) {
+            DecodedImage &d = img.wait();
+            counters.image_decode_ms.push_back(d.decode_ms);
+            counters.image_resize_ms.push_back(d.resize_ms);
+            counters.image_peak_bytes = std::max(counters.image_peak_bytes, d.peak_bytes);
+            if (!d.bitmap && failed.empty()) failed = img.path;
+            bitmaps.push_back(std::move(d.bitmap));
+        }
+        counters.image_wait_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
 
-            llama_pos new_n_past = 0;
-            int32_t eval_res = mtmd_helper_eval_chunks(mtmd_ctx, ctx, chunks.ptr.get(), n_past, 0, 512, true, &new_n_past);
+        if (!failed.empty())
+            throw std::runtime_error("pivision: failed to load image: " + failed);
+        return bitmaps;
+    }
 
-            if (eval_res != 0)
-                throw std::runtime_error("pivision: mtmd_helper_eval_chunks failed (code " + std::to_string(eval_res) + ")");
+    // Decodes text tokens at n_past.. in n_batch slices, with logits only for the final token
+    void decode_tokens(const llama_token *tokens, size_t n, bool logits_last) {
+        namespace chr = std::chrono;
+        const size_t n_batch = llama_n_batch(ctx);
 
-            n_past = new_n_past;
-        } else {
-            std::vector<llama_token> tokens(formatted.size() + 64);
-            int n = llama_tokenize(vocab, formatted.c_str(), formatted.size(), tokens.data(), tokens.size(), add_bos, true);
+        for (size_t i = 0; i < n; i += n_batch) {
+            const size_t n_eval = std::min(n - i, n_batch);
 
-            if (n < 0) {
-                tokens.resize(-n);
-                n = llama_tokenize(vocab, formatted.c_str(), formatted.size(), tokens.data(), tokens.size(), add_bos, true);
-            }
-            tokens.resize(n);
+            common_batch_clear(batch);
+            for (size_t j = 0; j < n_eval; ++j)
+                common_batch_add(batch, tokens[i + j], n_past + static_cast<llama_pos>(j), {0}, logits_last && i + j + 1 == n);
 
-            llama_batch batch = llama_batch_get_one(tokens.data(), n);
+            auto t0 = chr::steady_clock::now();
             if (llama_decode(ctx, batch))
                 throw std::runtime_error("pivision: failed to eval text prompt");
+            double ms = chr::duration<double, std::milli>(chr::steady_clock::now() - t0).count();
+            counters.prompt_ms += ms;
+            counters.prefill_ms += ms;
 
-            n_past += n;
+            n_past += static_cast<llama_pos>(n_eval);
         }
-    }
 
-    std::string sample_response(std::function<void(const std::string &)> stream_cb) {
-        std::string content;
-        const int max_tokens = config.n_ctx - static_cast<int>(n_past);
+        counters.prompt_tokens += static_cast<int>(n);
+        kv_tokens.insert(kv_tokens.end(), tokens, tokens + n);
+    }
 
-        for (int i = 0; i < max_tokens; ++i) {
-            llama_token id = llama_sampler_sample(sampler, ctx, -1);
-            if (llama_vocab_is_eog(vocab, id)) break;
+    // Decodes an image chunk from its cached embedding, running the vision encoder only on a miss,
+    // into `seq_id` at `pos`, which is advanced past the image
+    int32_t eval_image_chunk(const mtmd_input_chunk *chunk, llama_seq_id seq_id, llama_pos &pos) {
+        namespace chr = std::chrono;
 
-            char buf[256];
-            int n = llama_token_to_piece(vocab, id, buf, sizeof(buf), 0, true);
-            if (n > 0) {
-                std::string piece(buf, static_cast<size_t>(n));
-                content += piece;
-                if (stream_cb) stream_cb(piece);
+        const char *image_id = mtmd_input_chunk_get_id(chunk);
+        const size_t n_tokens = mtmd_input_chunk_get_n_tokens(chunk);
+        const size_t n_floats = n_tokens * static_cast<size_t>(llama_model_n_embd(model));
+        const bool cacheable = image_id && embd_cache->enabled();
+        const std::string key = cacheable ? projector_id + "-" + image_id : std::string();
+
+        const float *embd = nullptr;
+        const EmbdCache::Entry *entry = cacheable ? embd_cache->find(key, n_floats) : nullptr;
+        if (entry) {
+            embd = entry->data;
+            counters.embd_cache_hits++;
+            counters.embd_cache_saved_ms += entry->encode_ms;
+        } else {
+            auto t0 = chr::steady_clock::now();
+            int32_t res = mtmd_encode_chunk(mtmd_ctx, chunk);
+            if (res != 0) return res;
+            double encode_ms = chr::duration<double, std::milli>(chr::steady_clock::now() - t0).count();
+            counters.encode_ms += encode_ms;
+
+            embd = mtmd_get_output_embd(mtmd_ctx);
+            if (cacheable) {
+                embd = embd_cache->store(key, embd, n_floats, encode_ms)->data;
+                counters.embd_cache_misses++;
             }
+        }
 
-            llama_batch batch = llama_batch_get_one(&id, 1);
-            if (llama_decode(ctx, batch)) {
-                fprintf(stderr, "[pivision] decode failed at token %d\n", i);
-                break;
+        auto t0 = chr::steady_clock::now();
+        llama_pos new_pos = pos;
+        int32_t res = mtmd_helper_decode_image_chunk(mtmd_ctx, ctx, chunk, const_cast<float *>(embd),
+                                                     pos, seq_id, static_cast<int32_t>(llama_n_batch(ctx)), &new_pos);
+        double ms = chr::duration<double, std::milli>(chr::steady_clock::now() - t0).count();
+        counters.prompt_ms += ms;
+        counters.image_embd_ms += ms;
+        counters.prompt_tokens += static_cast<int>(n_tokens);
+        pos = new_pos;
+        return res;
+    }
+
+    // Stand-in token recorded for every position of an image. Once the table is
+    // large, ids no longer held by seq 0 or a pin are dropped so --watch stays bounded.
+    llama_token image_pseudo_token(const char *image_id) {
+        if (!image_id) return LLAMA_TOKEN_NULL;
+        auto it = image_tokens.find(image_id);
+        if (it != image_tokens.end()) return it->second;
+
+        if (image_tokens.size() >= 256) {
+            auto held = [&](llama_token t) {
+                if (std::find(kv_tokens.begin(), kv_tokens.end(), t) != kv_tokens.end()) return true;
+                for (const auto &pin : pins)
+                    if (std::find(pin.tokens.begin(), pin.tokens.end(), t) != pin.tokens.end()) return true;
+                return false;
+            };
+            for (auto i = image_tokens.begin(); i != image_tokens.end();)
+                i = held(i->second) ? std::next(i) : image_tokens.erase(i);
+        }
+        return image_tokens[image_id] = next_image_token--;
+    }
+
+    // Tokenizes a formatted prompt into text/image pieces. `chunks` owns the mtmd
+    // chunks the image pieces point into and must outlive their evaluation.
+    std::vector<PromptChunk> tokenize_prompt(const std::string &formatted, bool add_bos, mtmd::input_chunks &chunks) {
+        namespace chr = std::chrono;
+        std::vector<PromptChunk> out;
+
+        if (!images.empty() && mtmd_ctx) {
+            std::vector<mtmd::bitmap_ptr> bitmaps = collect_images();
+            auto t0 = chr::steady_clock::now();
+
+            mtmd_input_text text;
+            text.text = formatted.c_str();
+            text.add_special = add_bos;
+            text.parse_special = true;
+
+            std::vector<const mtmd_bitmap *> bmp_ptrs;
+            bmp_ptrs.reserve(bitmaps.size());
+            for (auto &b : bitmaps)
+                bmp_ptrs.push_back(b.get());
+
+            int32_t tok_res = mtmd_tokenize(mtmd_ctx, chunks.ptr.get(), &text, bmp_ptrs.data(), bmp_ptrs.size());
+            if (tok_res != 0)
+                throw std::runtime_error("pivision: mtmd_tokenize failed (code " + std::to_string(tok_res) + ")");
+
+            for (size_t i = 0; i < chunks.size(); ++i) {
+                const mtmd_input_chunk *chunk = chunks[i];
+                PromptChunk pc;
+                if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_IMAGE) {
+                    pc.image = chunk;
+                    pc.tokens.assign(mtmd_input_chunk_get_n_tokens(chunk), image_pseudo_token(mtmd_input_chunk_get_id(chunk)));
+                } else {
+                    size_t n = 0;
+                    const llama_token *toks = mtmd_input_chunk_get_tokens_text(chunk, &n);
+                    pc.tokens.assign(toks, toks + n);
+                }
+                out.push_back(std::move(pc));
             }
-            ++n_past;
+            counters.tokenize_ms += chr::duration<double, std::milli>(chr::steady_clock::now() - t0).count();
+            return out;
         }
-        return content;
+
+        auto t0 = chr::steady_clock::now();
+        std::vector<llama_token> tokens(formatted.size() + 64);
+        int n = llama_tokenize(vocab, formatted.c_str(), formatted.size(), tokens.data(), tokens.size(), add_bos, true);
+
+        if (n < 0) {
+            tokens.resize(-n);
+            n = llama_tokenize(vocab, formatted.c_str(), formatted.size(), tokens.data(), tokens.size(), add_bos, true);
+        }
+        tokens.resize(n);
+        counters.tokenize_ms += chr::duration<double, std::milli>(chr::steady_clock::now() - t0).count();
+
+        PromptChunk pc;
+        pc.tokens = std::move(tokens);
+        out.push_back(std::move(pc));
+        return out;
     }
 
-    void run_inner(const std::string &prompt, std::function<void(const std::string &)> stream_cb, RunResult &out) {
+    // Trims seq 0 down to the longest prefix shared with `prompt` – from the last
+    // request or from a pinned prefix – and returns how many positions are kept
+    size_t reuse_prefix(const std::vector<PromptChunk> &prompt) {
+        llama_memory_t mem = llama_get_memory(ctx);
+
+        std::vector<llama_token> flat;
+        for (const auto &pc : prompt)
+            flat.insert(flat.end(), pc.tokens.begin(), pc.tokens.end());
+
+        size_t n_keep = 0;
+        if (config.prompt_cache && !mrope) {
+            n_keep = common_prefix(kv_tokens, flat);
+
+            const PinnedPrefix *best = nullptr;
+            for (const auto &pin : pins) {
+                size_t n = common_prefix(pin.tokens, flat);
+                if (n > n_keep) {
+                    n_keep = n;
+                    best = &pin;
+                }
+            }
+            if (best) {
+                llama_memory_seq_rm(mem, 0, -1, -1);
+                llama_memory_seq_cp(mem, best->seq_id, 0, -1, -1);
+                kv_tokens = best->tokens;
+            }
+        }
 
-        namespace chr = std::chrono;
-        auto wall_start = chr::steady_clock::now();
+        // Always decode at least the last token so there are fresh logits to sample from
+        if (!flat.empty() && n_keep >= flat.size())
+            n_keep = flat.size() - 1;
 
-        const int n_images = static_cast<int>(bitmaps.size());
+        // An image is decoded as one unit, never resumed half way
+        size_t pos = 0;
+        for (const auto &pc : prompt) {
+            if (pc.image && pos < n_keep && n_keep < pos + pc.tokens.size())
+                n_keep = pos;
+            pos += pc.tokens.size();
+        }
 
-        llama_memory_clear(llama_get_memory(ctx), true);
-        llama_perf_context_reset(ctx);
-        n_past = 0;
+        if (n_keep > 0 && !llama_memory_seq_rm(mem, 0, static_cast<llama_pos>(n_keep), -1))
+            n_keep = 0;
+        // Sliding-window layers may have already dropped positions the kept prefix depends on
+        if (n_keep > 0 && llama_memory_seq_pos_min(mem, 0) > 0)
+            n_keep = 0;
+        if (n_keep == 0)
+            llama_memory_seq_rm(mem, 0, -1, -1);
+
+        kv_tokens.resize(n_keep);
+        n_past = static_cast<llama_pos>(n_keep);
+        counters.prompt_tokens_reused = static_cast<int>(n_keep);
+        return n_keep;
+    }
+
+    // Tokenize and eval a formatted prompt. Pass add_bos=true for the first turn.
+    // With reuse=true (single-shot) only the part that differs from what seq 0
+    // already holds is decoded; otherwise the prompt is appended at n_past (chat).
+    void eval_prompt(const std::string &formatted, bool add_bos, bool reuse) {
+        mtmd::input_chunks chunks(mtmd_input_chunks_init());
+        std::vector<PromptChunk> prompt = tokenize_prompt(formatted, add_bos, chunks);
+        eval_chunks(prompt, reuse ? reuse_prefix(prompt) : 0);
+    }
+
+    // Evaluates tokenized prompt pieces, skipping the first n_keep positions
+    void eval_chunks(const std::vector<PromptChunk> &prompt, size_t n_keep) {
+        size_t pos = 0;
+        for (size_t i = 0; i < prompt.size(); ++i) {
+            const PromptChunk &pc = prompt[i];
+            const size_t start = pos;
+            pos += pc.tokens.size();
+            if (pos <= n_keep) continue;  // already in the KV cache
+
+            if (pc.image) {
+                int32_t res = eval_image_chunk(pc.image, 0, n_past);
+                if (res != 0)
+                    throw std::runtime_error("pivision: failed to eval image chunk (code " + std::to_string(res) + ")");
+                kv_tokens.insert(kv_tokens.end(), pc.tokens.begin(), pc.tokens.end());
+            } else {
+                const size_t skip = n_keep > start ? n_keep - start : 0;
+                decode_tokens(pc.tokens.data() + skip, pc.tokens.size() - skip, i + 1 == prompt.size());
+            }
+        }
+    }
+
+    // Positions seq 0 may fill: pinned prefixes in seqs 1..N hold cells of the
+    // same unified KV cache
+    int seq0_ctx() const {
+        int n = config.n_ctx;
+        for (const auto &pin : pins)
+            n -= static_cast<int>(pin.tokens.size());
+        return n;
+    }
+
+    // Room kept free for the reply when making space for a new chat turn
+    int reply_reserve() const {
+        return std::min(config.n_ctx / 4, 512);
+    }
 
+    // Sliding-window policy: drops the oldest chat turns after the pinned first
+    // one until `n_needed` positions are free, shifting the later turns down so
+    // nothing is re-evaluated. Returns the number of positions freed.
+    int evict_turns(int n_needed) {
+        const int room = seq0_ctx() - static_cast<int>(n_past);
+        if (n_needed <= room || config.context_policy != "sliding_window" || turns.size() < 2 || mrope)
+            return 0;
+
+        llama_memory_t mem = llama_get_memory(ctx);
+        if (!llama_memory_can_shift(mem))
+            return 0;
+
+        size_t n_drop = 0;
+        int freed = 0;
+        while (1 + n_drop < turns.size() && room + freed < n_needed) {
+            freed += static_cast<int>(turns[1 + n_drop].p1 - turns[1 + n_drop].p0);
+            ++n_drop;
+        }
+
+        const llama_pos p0 = turns[1].p0;
+        const llama_pos p1 = turns[n_drop].p1;
+        llama_memory_seq_rm(mem, 0, p0, p1);
+        llama_memory_seq_add(mem, 0, p1, -1, -(p1 - p0));
+
+        kv_tokens.erase(kv_tokens.begin() + p0, kv_tokens.begin() + p1);
+        n_past -= p1 - p0;
+        if (turn_p0 >= p1) turn_p0 -= p1 - p0;
+        for (size_t i = 1 + n_drop; i < turns.size(); ++i) {
+            turns[i].p0 -= p1 - p0;
+            turns[i].p1 -= p1 - p0;
+        }
+        turns.erase(turns.begin() + 1, turns.begin() + 1 + n_drop);
+        // Each turn is a user message followed by the assistant reply
+        chat_history.erase(chat_history.begin() + 2, chat_history.begin() + 2 + 2 * n_drop);
+
+        counters.tokens_evicted += freed;
+        return freed;
+    }
+
+    // Evaluates `prefix` as the head of a single-shot prompt and keeps a copy of
+    // its KV cells in a sequence of its own, so it survives unrelated requests
+    bool pin_prefix_inner(const std::string &name, const std::string &prefix) {
+        if (!config.prompt_cache || mrope) {
+            fprintf(stderr, "[pivision] prompt cache disabled, cannot pin '%s'\n", name.c_str());
+            return false;
+        }
+
+        auto it = std::find_if(pins.begin(), pins.end(), [&](const PinnedPrefix &p) { return p.name == name; });
+        llama_seq_id seq_id = -1;
+        if (it != pins.end()) {
+            seq_id = it->seq_id;
+        } else {
+            for (llama_seq_id s = 1; s <= config.max_pinned_prefixes && seq_id < 0; ++s)
+                if (std::none_of(pins.begin(), pins.end(), [&](const PinnedPrefix &p) { return p.seq_id == s; }))
+                    seq_id = s;
+            if (seq_id < 0) {
+                fprintf(stderr, "[pivision] all %d pinned prefix slots in use\n", config.max_pinned_prefixes);
+                return false;
+            }
+        }
+
+        const int n_images = static_cast<int>(images.size());
         const std::string marker = mtmd_ctx ? std::string(mtmd_default_marker()) : std::string();
         const char *tmpl = chat_template.empty() ? nullptr : chat_template.c_str();
-        std::string full_prompt = format_chat_prompt(tmpl, prompt, n_images, marker);
+        std::string formatted = format_chat_prompt(tmpl, prefix, n_images, marker);
+
+        // Keep the template head up to the end of the prefix text
+        size_t end = formatted.rfind(prefix);
+        if (end != std::string::npos) {
+            end += prefix.size();
+        } else {
+            const std::string trimmed = prefix.substr(0, prefix.find_last_not_of(" \t\r\n") + 1);
+            end = trimmed.empty() ? std::string::npos : formatted.rfind(trimmed);
+            if (end == std::string::npos) {
+                fprintf(stderr, "[pivision] prefix '%s' not found in templated prompt\n", name.c_str());
+                images.clear();
+                return false;
+            }
+            end += trimmed.size();
+        }
+        formatted.resize(end);
 
-        eval_prompt(full_prompt, true);
+        counters = RunCounters{};
+        eval_prompt(formatted, true, true);
 
-        auto ttft_start = chr::steady_clock::now();
-        bool ttft_recorded = false;
-        double ttft_ms = 0.0;
+        llama_memory_t mem = llama_get_memory(ctx);
+        llama_memory_seq_rm(mem, seq_id, -1, -1);
+        llama_memory_seq_cp(mem, 0, seq_id, -1, -1);
 
-        auto wrapped_cb = [&](const std::string &piece) {
-            if (!ttft_recorded) {
-                ttft_ms = chr::duration<double, std::milli>(chr::steady_clock::now() - ttft_start).count();
-                ttft_recorded = true;
+        if (it != pins.end())
+            it->tokens = kv_tokens;
+        else
+            pins.push_back({name, seq_id, kv_tokens});
+        return true;
+    }
+
+    void unpin_prefix_inner(const std::string &name) {
+        auto it = std::find_if(pins.begin(), pins.end(), [&](const PinnedPrefix &p) { return p.name == name; });
+        if (it == pins.end()) return;
+        llama_memory_seq_rm(llama_get_memory(ctx), it->seq_id, -1, -1);
+        pins.erase(it);
+    }
+
+    // Installs a request's limits and grammar; throws before any work is done
+    // when the grammar or schema is invalid
+    void begin_generation(const GenerationParams &params) {
+        if (grammar) {
+            llama_sampler_free(grammar);
+            grammar = nullptr;
+        }
+        gen = params;
+        // Every request starts from the same penalty history and seed
+        llama_sampler_reset(sampler);
+        const std::string gbnf = request_grammar(gen);
+        if (!gbnf.empty()) {
+            grammar = llama_sampler_init_grammar(vocab, gbnf.c_str(), "root");
+            if (!grammar)
+                throw std::runtime_error("pivision: invalid grammar");
+        }
+    }
+
+    uint32_t issue_request() {
+        const uint32_t id = ++next_request;
+        active_request = id;
+        return id;
+    }
+
+    bool cancelled() const {
+        return cancelled_request.load(std::memory_order_relaxed) == request_id
+            || (handle_cancel && handle_cancel->load(std::memory_order_relaxed));
+    }
+
+    // Checked between decode steps: records why the request has to end early
+    bool interrupted() {
+        if (cancelled())
+            counters.stop_reason = "cancelled";
+        else if (std::chrono::steady_clock::now() >= deadline)
+            counters.stop_reason = "deadline";
+        else
+            return false;
+        return true;
+    }
+
+    // Appends one generated token's piece to `content` and streams it,
+    // timestamped relative to request_start. Returns false once the reply
+    // reaches a stop string; content then ends before it.
+    bool emit_piece(llama_token id, std::string &content, const TokenCallback &event_cb) {
+        namespace chr = std::chrono;
+        auto t0 = chr::steady_clock::now();
+        char buf[256];
+        int n = llama_token_to_piece(vocab, id, buf, sizeof(buf), 0, true);
+        auto t1 = chr::steady_clock::now();
+        counters.detok_ms += chr::duration<double, std::milli>(t1 - t0).count();
+        if (n <= 0) return true;
+
+        const double t_ms = chr::duration<double, std::milli>(t1 - request_start).count();
+        if (content.empty()) counters.ttft_ms = t_ms;
+        content.append(buf, static_cast<size_t>(n));
+
+        size_t n_ready = content.size();
+        if (!gen.stop.empty()) {
+            const size_t pos = find_stop(content, static_cast<size_t>(n), gen.stop);
+            if (pos != std::string::npos) {
+                content.resize(pos);
+                stream_text(content, pos, id, t_ms, event_cb);
+                counters.stop_reason = "stop";
+                return false;
             }
-            if (stream_cb) stream_cb(piece);
-        };
+            // Text that may turn out to be the start of a stop string waits
+            n_ready -= stop_prefix_len(content, gen.stop);
+        }
+        stream_text(content, n_ready, id, t_ms, event_cb);
+        return true;
+    }
 
-        out.content = sample_response(wrapped_cb);
+    // Passes content[n_streamed, n_ready) to the stream as one piece
+    void stream_text(const std::string &content, size_t n_ready, llama_token id, double t_ms,
+                     const TokenCallback &event_cb) {
+        if (n_ready <= counters.n_streamed) return;
+
+        TokenEvent ev;
+        ev.piece = content.substr(counters.n_streamed, n_ready - counters.n_streamed);
+        ev.token = id;
+        ev.index = counters.n_pieces++;
+        ev.t_ms = t_ms;
+        ev.dt_ms = ev.index == 0 ? ev.t_ms : ev.t_ms - counters.last_piece_ms;
+        counters.last_piece_ms = ev.t_ms;
+        counters.n_streamed = n_ready;
+        if (event_cb) event_cb(ev);
+    }
 
-        auto wall_end = chr::steady_clock::now();
-        auto perf = llama_perf_context(ctx);
+    // Releases text held back for a possible stop string once the reply has ended otherwise
+    void flush_stream(const std::string &content, const TokenCallback &event_cb) {
+        const double t_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - request_start).count();
+        stream_text(content, content.size(), LLAMA_TOKEN_NULL, t_ms, event_cb);
+    }
 
-        out.model_desc = model_desc;
-        out.images_processed = n_images;
-        out.prompt_tokens = perf.n_p_eval;
-        out.gen_tokens = perf.n_eval;
-        out.total_tokens = perf.n_p_eval + perf.n_eval;
-        out.prompt_ms = perf.t_p_eval_ms;
-        out.gen_ms = perf.t_eval_ms;
-        out.ttft_ms = ttft_ms;
-        out.wall_ms = chr::duration<double, std::milli>(wall_end - wall_start).count();
+    // Under a grammar, the unconstrained pick is checked against it first; the
+    // grammar only runs over the whole vocabulary when it rejects that pick
+    llama_token sample_token(int32_t idx) {
+        auto t0 = std::chrono::steady_clock::now();
+        llama_token id;
+        if (!grammar) {
+            id = greedy ? argmax(idx) : llama_sampler_sample(sampler, ctx, idx);
+        } else {
+            id = greedy ? argmax(idx) : sample_candidates(idx, false);
+            llama_token_data single = {id, 1.0f, 0.0f};
+            llama_token_data_array one = {&single, 1, -1, false};
+            llama_sampler_apply(grammar, &one);
+            if (std::isinf(single.logit))
+                id = sample_candidates(idx, true);
+            llama_sampler_accept(grammar, id);
+            llama_sampler_accept(sampler, id);
+        }
+        counters.sample_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        return id;
+    }
+
+    // Runs the sampler chain over the logits of batch row idx without accepting
+    // the result; constrained applies the grammar first
+    llama_token sample_candidates(int32_t idx, bool constrained) {
+        const float *logits = llama_get_logits_ith(ctx, idx);
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+        candidates.resize(static_cast<size_t>(n_vocab));
+        for (llama_token t = 0; t < n_vocab; ++t)
+            candidates[t] = {t, logits[t], 0.0f};
+        llama_token_data_array cur = {candidates.data(), candidates.size(), -1, false};
+        if (constrained)
+            llama_sampler_apply(grammar, &cur);
+        llama_sampler_apply(sampler, &cur);
+        return cur.data[cur.selected].id;
+    }
+
+    // Proposes up to n_max tokens to follow id_last with the draft model. The
+    // draft only ever sees the text tokens of seq 0; its KV cache is trimmed to
+    // what it shares with them, so only new tokens are evaluated.
+    std::vector<llama_token> draft_tokens(llama_token id_last, int n_max) {
+        std::vector<llama_token> hist;
+        hist.reserve(kv_tokens.size() + 1);
+        for (llama_token t : kv_tokens)
+            if (t >= 0) hist.push_back(t);
+        hist.push_back(id_last);
+
+        std::vector<llama_token> out;
+        if (hist.size() + static_cast<size_t>(n_max) > llama_n_ctx(draft_ctx))
+            return out;
+
+        size_t n_keep = std::min(common_prefix(draft_kv, hist), hist.size() - 1);
+        llama_memory_seq_rm(llama_get_memory(draft_ctx), 0, static_cast<llama_pos>(n_keep), -1);
+        draft_kv.resize(n_keep);
+
+        const size_t n_batch = llama_n_batch(draft_ctx);
+        for (size_t i = n_keep; i < hist.size(); i += n_batch) {
+            const size_t n_eval = std::min(hist.size() - i, n_batch);
+            common_batch_clear(draft_batch);
+            for (size_t j = i; j < i + n_eval; ++j)
+                common_batch_add(draft_batch, hist[j], static_cast<llama_pos>(j), {0}, j + 1 == hist.size());
+            if (llama_decode(draft_ctx, draft_batch)) {
+                llama_memory_seq_rm(llama_get_memory(draft_ctx), 0, -1, -1);
+                draft_kv.clear();
+                return out;
+            }
+            draft_kv.insert(draft_kv.end(), hist.begin() + i, hist.begin() + i + n_eval);
+        }
+
+        for (int i = 0; i < n_max; ++i) {
+            llama_token t = llama_sampler_sample(draft_sampler, draft_ctx, -1);
+            if (llama_vocab_is_eog(vocab, t)) break;
+            out.push_back(t);
+            if (i + 1 == n_max) break;
+
+            common_batch_clear(draft_batch);
+            common_batch_add(draft_batch, t, static_cast<llama_pos>(draft_kv.size()), {0}, true);
+            if (llama_decode(draft_ctx, draft_batch)) break;
+            draft_kv.push_back(t);
+        }
+        return out;
+    }
+
+    // Speculative generation: each step decodes the pending token together with
+    // the draft's proposals in one batch and keeps the proposals the target
+    // sampler agrees with, in order. Rejected proposals are removed from the KV cache.
+    std::string sample_speculative(const TokenCallback &event_cb, bool allow_shift) {
+        namespace chr = std::chrono;
+        std::string content;
+        llama_memory_t mem = llama_get_memory(ctx);
+
+        llama_token id = sample_token(-1);
+        for (;;) {
+            if (llama_vocab_is_eog(vocab, id)) {
+                counters.stop_reason = "eos";
+                break;
+            }
+            if (interrupted())
+                break;
+            if (gen.max_tokens > 0 && counters.gen_tokens >= gen.max_tokens) {
+                counters.stop_reason = "max_tokens";
+                break;
+            }
+            if (n_past >= seq0_ctx() && (!allow_shift || evict_turns(reply_reserve()) == 0)) {
+                counters.stop_reason = "context";
+                break;
+            }
+            thermal_tick();
+            if (!emit_piece(id, content, event_cb))
+                break;
+
+            const int room = seq0_ctx() - static_cast<int>(n_past) - 1;
+            // Proposals past max_tokens would be thrown away
+            const int budget = gen.max_tokens > 0 ? gen.max_tokens - counters.gen_tokens - 1 : room;
+            const int n_max = std::min({config.n_draft, room, budget, static_cast<int>(llama_n_batch(ctx)) - 1});
+
+            auto t0 = chr::steady_clock::now();
+            std::vector<llama_token> drafts;
+            if (n_max > 0) drafts = draft_tokens(id, n_max);
+            counters.draft_ms += chr::duration<double, std::milli>(chr::steady_clock::now() - t0).count();
+            counters.draft_tokens += static_cast<int>(drafts.size());
+
+            auto t1 = chr::steady_clock::now();
+            common_batch_clear(batch);
+            common_batch_add(batch, id, n_past, {0}, true);
+            for (size_t j = 0; j < drafts.size(); ++j)
+                common_batch_add(batch, drafts[j], n_past + 1 + static_cast<llama_pos>(j), {0}, true);
+            if (llama_decode(ctx, batch)) {
+                fprintf(stderr, "[pivision] decode failed at token %d\n", counters.gen_tokens);
+                counters.stop_reason = "error";
+                break;
+            }
+            counters.gen_ms += chr::duration<double, std::milli>(chr::steady_clock::now() - t1).count();
+            kv_tokens.push_back(id);
+            ++n_past;
+            counters.gen_tokens++;
+
+            // Output i of the batch predicts the token after batch[i]
+            bool stop = false;
+            size_t n_accepted = 0;
+            for (;;) {
+                llama_token t = sample_token(static_cast<int32_t>(n_accepted));
+                if (n_accepted == drafts.size() || t != drafts[n_accepted]) {
+                    id = t;
+                    break;
+                }
+                if (!emit_piece(t, content, event_cb)) {
+                    stop = true;
+                    break;
+                }
+                kv_tokens.push_back(t);
+                ++n_past;
+                ++n_accepted;
+                counters.gen_tokens++;
+            }
+            llama_memory_seq_rm(mem, 0, n_past, -1);
+            counters.draft_accepted += static_cast<int>(n_accepted);
+            if (stop) break;
+        }
+        flush_stream(content, event_cb);
+        return content;
+    }
+
+    // Called once per generated token. Every thermal_sample_ms it reads the
+    // sensor: at or above thermal_hard_c it halves the generation threads and
+    // adds per-token pacing, at or above thermal_soft_c it drops one thread,
+    // and once 3 °C below thermal_soft_c it undoes one step at a time.
+    void thermal_tick() {
+        namespace chr = std::chrono;
+        if (!thermal_on) return;
+
+        auto now = chr::steady_clock::now();
+        const bool due = counters.thermal_trace.empty()
+            || now - thermal_last >= chr::milliseconds(config.thermal_sample_ms);
+        if (due) {
+            thermal_last = now;
+            const float temp = read_temp_c(config.thermal_zone);
+            if (!std::isnan(temp)) {
+                const int min_threads = std::max(config.thermal_min_threads, 1);
+                int threads = llama_n_threads(ctx);
+                double pace = thermal_pace_ms;
+
+                if (temp >= config.thermal_hard_c) {
+                    threads = std::max(min_threads, threads / 2);
+                    pace = std::min(pace + 20.0, 200.0);
+                } else if (temp >= config.thermal_soft_c) {
+                    threads = std::max(min_threads, threads - 1);
+                } else if (temp < config.thermal_soft_c - 3.0f) {
+                    if (pace > 0.0) pace = std::max(pace - 20.0, 0.0);
+                    else threads = std::min(thermal_base_threads, threads + 1);
+                }
+
+                std::string action;
+                if (threads != llama_n_threads(ctx)) {
+                    action = "threads " + std::to_string(llama_n_threads(ctx)) + " -> " + std::to_string(threads);
+                    llama_set_n_threads(ctx, threads, llama_n_threads_batch(ctx));
+                }
+                if (pace != thermal_pace_ms) {
+                    if (!action.empty()) action += ", ";
+                    action += "pace " + std::to_string(static_cast<int>(pace)) + " ms";
+                    thermal_pace_ms = pace;
+                }
+
+                ThermalSample ts;
+                ts.t_ms = chr::duration<double, std::milli>(now - request_start).count();
+                ts.temp_c = temp;
+                ts.n_threads = threads;
+                ts.pace_ms = thermal_pace_ms;
+                ts.action = action;
+                counters.thermal_trace.push_back(ts);
+                if (std::isnan(counters.temp_max_c) || temp > counters.temp_max_c)
+                    counters.temp_max_c = temp;
+            }
+        }
+
+        if (thermal_pace_ms > 0.0) {
+            std::this_thread::sleep_for(chr::duration<double, std::milli>(thermal_pace_ms));
+            counters.thermal_pause_ms += thermal_pace_ms;
+        }
+    }
+
+    // allow_shift lets a chat reply that fills the context evict older turns
+    std::string sample_response(const TokenCallback &event_cb, bool allow_shift) {
+        if (draft_ctx)
+            return sample_speculative(event_cb, allow_shift);
+
+        std::string content;
+
+        // Every token emitted is decoded before the next check, so an
+        // interrupted reply leaves n_past and the KV cache consistent
+        for (int i = 0; ; ++i) {
+            if (gen.max_tokens > 0 && counters.gen_tokens >= gen.max_tokens) {
+                counters.stop_reason = "max_tokens";
+                break;
+            }
+            if (interrupted())
+                break;
+            if (n_past >= seq0_ctx() && (!allow_shift || evict_turns(reply_reserve()) == 0)) {
+                counters.stop_reason = "context";
+                break;
+            }
+
+            llama_token id = sample_token(-1);
+            if (llama_vocab_is_eog(vocab, id)) {
+                counters.stop_reason = "eos";
+                break;
+            }
+
+            // A stop string ends the reply before its token is decoded
+            if (!emit_piece(id, content, event_cb))
+                break;
+            thermal_tick();
+
+            auto t0 = std::chrono::steady_clock::now();
+            llama_batch one = llama_batch_get_one(&id, 1);
+            if (llama_decode(ctx, one)) {
+                fprintf(stderr, "[pivision] decode failed at token %d\n", i);
+                counters.stop_reason = "error";
+                break;
+            }
+            counters.gen_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+            counters.gen_tokens++;
+            kv_tokens.push_back(id);
+            ++n_past;
+        }
+        flush_stream(content, event_cb);
+        return content;
+    }
+
+    void run_inner(const std::string &prompt, const TokenCallback &event_cb, const GenerationParams &params,
+                   RunResult &out) {
+        begin_generation(params);
+
+        namespace chr = std::chrono;
+        auto wall_start = chr::steady_clock::now();
+        request_start = wall_start;
+        deadline = request_deadline(gen, wall_start);
+
+        const int n_images = static_cast<int>(images.size());
+
+        counters = RunCounters{};
+
+        // Cancelled before it started: no image work or prefill
+        if (interrupted()) {
+            clear_images();
+            finish_result(out, 0, wall_start);
+            return;
+        }
+
+        const std::string marker = mtmd_ctx ? std::string(mtmd_default_marker()) : std::string();
+        const char *tmpl = chat_template.empty() ? nullptr : chat_template.c_str();
+        std::string full_prompt = format_chat_prompt(tmpl, prompt, n_images, marker);
+
+        eval_prompt(full_prompt, true, true);
+
+        out.content = sample_response(event_cb, false);
 
-        double gen_sec = perf.t_eval_ms / 1000.0;
-        out.tokens_per_sec = gen_sec > 0.0 ? static_cast<double>(perf.n_eval) / gen_sec : 0.0;
+        finish_result(out, n_images, wall_start);
     }
 
-    void chat_turn_inner(const std::string &user_message, std::function<void(const std::string &)> stream_cb, RunResult &out) {
+    void chat_turn_inner(const std::string &user_message, const TokenCallback &event_cb,
+                         const GenerationParams &params, RunResult &out) {
+        begin_generation(params);
 
         namespace chr = std::chrono;
         auto wall_start = chr::steady_clock::now();
+        request_start = wall_start;
+        deadline = request_deadline(gen, wall_start);
 
-        const int n_images = static_cast<int>(bitmaps.size());
+        const int n_images = static_cast<int>(images.size());
         bool is_first = chat_history.empty();
+        counters = RunCounters{};
+
+        // Cancelled before it started: the conversation stays as it was
+        if (interrupted()) {
+            clear_images();
+            finish_result(out, 0, wall_start);
+            return;
+        }
 
         const std::string marker = mtmd_ctx ? std::string(mtmd_default_marker()) : std::string();
         std::string content;
@@ -318,51 +2186,599 @@ struct PiVision::Impl {
             tmpls.get(), chat_history, user_msg, true, false);
 
         chat_history.push_back(user_msg);
-        llama_perf_context_reset(ctx);
-        eval_prompt(formatted, is_first);
 
-        auto ttft_start = chr::steady_clock::now();
-        bool ttft_recorded = false;
-        double ttft_ms = 0.0;
+        // A new conversation starts from an empty seq 0, whatever single-shot runs left there
+        if (is_first) {
+            llama_memory_seq_rm(llama_get_memory(ctx), 0, -1, -1);
+            kv_tokens.clear();
+            turns.clear();
+            n_past = 0;
+        }
 
-        auto wrapped_cb = [&](const std::string &piece) {
-            if (!ttft_recorded) {
-                ttft_ms = chr::duration<double, std::milli>(chr::steady_clock::now() - ttft_start).count();
-                ttft_recorded = true;
-            }
-            if (stream_cb) stream_cb(piece);
-        };
+        mtmd::input_chunks chunks(mtmd_input_chunks_init());
+        std::vector<PromptChunk> prompt = tokenize_prompt(formatted, is_first, chunks);
+        int n_prompt = 0;
+        for (const auto &pc : prompt)
+            n_prompt += static_cast<int>(pc.tokens.size());
 
-        out.content = sample_response(wrapped_cb);
+        evict_turns(n_prompt + reply_reserve());
+        turn_p0 = n_past;
+        eval_chunks(prompt, 0);
 
-        auto wall_end = chr::steady_clock::now();
+        out.content = sample_response(event_cb, true);
 
         common_chat_msg asst_msg;
         asst_msg.role = "assistant";
         asst_msg.content = out.content;
         chat_history.push_back(asst_msg);
+        turns.push_back({turn_p0, n_past});
 
-        auto perf = llama_perf_context(ctx);
+        finish_result(out, n_images, wall_start);
+    }
+
+    void fill_kv_info(RunResult &out) const {
+        out.kv_type_k = config.cache_type_k;
+        out.kv_type_v = config.cache_type_v;
+        out.flash_attn = config.flash_attn;
+        out.kv_bytes = plan.kv_bytes;
+    }
+
+    void finish_result(RunResult &out, int n_images, std::chrono::steady_clock::time_point wall_start) {
+        namespace chr = std::chrono;
+        auto wall_end = chr::steady_clock::now();
 
         out.model_desc = model_desc;
         out.images_processed = n_images;
-        out.prompt_tokens = perf.n_p_eval;
-        out.gen_tokens = perf.n_eval;
-        out.total_tokens = perf.n_p_eval + perf.n_eval;
-        out.prompt_ms = perf.t_p_eval_ms;
-        out.gen_ms = perf.t_eval_ms;
-        out.ttft_ms = ttft_ms;
+        out.prompt_tokens = counters.prompt_tokens;
+        out.prompt_tokens_reused = counters.prompt_tokens_reused;
+        out.gen_tokens = counters.gen_tokens;
+        out.total_tokens = counters.prompt_tokens + counters.gen_tokens;
+        out.prompt_ms = counters.prompt_ms;
+        out.gen_ms = counters.gen_ms;
+        // Measured from the start of the request, so it covers image decode,
+        // encoding and prefill
+        out.ttft_ms = counters.ttft_ms;
         out.wall_ms = chr::duration<double, std::milli>(wall_end - wall_start).count();
 
-        double gen_sec = perf.t_eval_ms / 1000.0;
-        out.tokens_per_sec = gen_sec > 0.0 ? static_cast<double>(perf.n_eval) / gen_sec : 0.0;
+        // Drafting is part of the generation cost, so tok/s is the effective rate
+        double gen_sec = (counters.gen_ms + counters.draft_ms) / 1000.0;
+        out.tokens_per_sec = gen_sec > 0.0 ? static_cast<double>(counters.gen_tokens) / gen_sec : 0.0;
+
+        out.embd_cache_hits = counters.embd_cache_hits;
+        out.embd_cache_misses = counters.embd_cache_misses;
+        out.embd_cache_saved_ms = counters.embd_cache_saved_ms;
+
+        out.context_policy = config.context_policy;
+
+        out.draft_tokens = counters.draft_tokens;
+        out.draft_accepted = counters.draft_accepted;
+        out.draft_acceptance = counters.draft_tokens > 0
+            ? static_cast<double>(counters.draft_accepted) / counters.draft_tokens : 0.0;
+        out.draft_ms = counters.draft_ms;
+
+        out.image_decode_ms = counters.image_decode_ms;
+        out.image_resize_ms = counters.image_resize_ms;
+        out.image_peak_bytes = counters.image_peak_bytes;
+        out.image_wait_ms = counters.image_wait_ms;
+        out.tokenize_ms = counters.tokenize_ms;
+        out.encode_ms = counters.encode_ms;
+        out.image_embd_ms = counters.image_embd_ms;
+        out.prefill_ms = counters.prefill_ms;
+        out.sample_ms = counters.sample_ms;
+        out.sampler = sampler_desc;
+        out.detok_ms = counters.detok_ms;
+
+        out.thermal_trace = counters.thermal_trace;
+        out.thermal_pause_ms = counters.thermal_pause_ms;
+        out.temp_max_c = std::isnan(counters.temp_max_c) ? 0.0f : counters.temp_max_c;
+        for (const auto &ts : counters.thermal_trace)
+            if (!ts.action.empty()) ++out.thermal_actions;
+
+        out.n_threads = llama_n_threads(ctx);
+        out.n_threads_batch = llama_n_threads_batch(ctx);
+        out.n_threads_vision = n_threads_vision;
+        out.cpu_mask = config.cpu_mask;
+        fill_kv_info(out);
+        out.tokens_evicted = counters.tokens_evicted;
+        out.stop_reason = counters.stop_reason;
+
+        // The model load is paid once per instance; only the first request reports it
+        out.load_ms = load_reported ? 0.0 : load_ms;
+        load_reported = true;
+    }
+
+    // Runs independent requests side by side, each in its own sequence after
+    // the pinned ones. Requests are admitted while a sequence is free and the
+    // KV cache has room for prompt + max_tokens; every step decodes one token
+    // of each generating request plus as much pending prompt text as fits in
+    // n_batch. Images are decoded per request once the text before them is in.
+    BatchResult run_batch_inner(const std::vector<BatchRequest> &requests) {
+        namespace chr = std::chrono;
+        auto wall_start = chr::steady_clock::now();
+
+        BatchResult out;
+        out.results.resize(requests.size());
+
+        // The instance counters carry what the batch shares: the thermal trace
+        counters = RunCounters{};
+        request_start = wall_start;
+
+        // Images loaded for the next run() are set aside while requests borrow `images`
+        std::vector<PendingImage> user_images = std::move(images);
+        images.clear();
+
+        // Every image starts decoding up front; requests pick theirs up on admission
+        std::vector<std::vector<PendingImage>> req_images(requests.size());
+        for (size_t i = 0; i < requests.size(); ++i)
+            for (const auto &path : requests[i].image_paths)
+                req_images[i].push_back(queue_decode(path));
+
+        llama_memory_t mem = llama_get_memory(ctx);
+        const int n_batch = static_cast<int>(llama_n_batch(ctx));
+        const llama_seq_id first_seq = 1 + std::max(config.max_pinned_prefixes, 0);
+
+        // Cells held outside the batch: seq 0 and the pinned prefixes
+        int reserved = static_cast<int>(n_past);
+        for (const auto &pin : pins)
+            reserved += static_cast<int>(pin.tokens.size());
+
+        std::vector<llama_seq_id> free_seqs;
+        for (llama_seq_id s = first_seq + std::max(config.n_parallel, 1) - 1; s >= first_seq; --s)
+            free_seqs.push_back(s);
+
+        const std::string marker = mtmd_ctx ? std::string(mtmd_default_marker()) : std::string();
+        const char *tmpl = chat_template.empty() ? nullptr : chat_template.c_str();
+
+        // Tokenizes request i, waiting for its images; nullptr if it failed
+        auto prepare = [&](size_t i) -> std::unique_ptr<BatchSlot> {
+            const GenerationParams &params = requests[i].gen;
+            auto slot = std::make_unique<BatchSlot>();
+            slot->index = i;
+            slot->max_tokens = params.max_tokens > 0 ? params.max_tokens : requests[i].max_tokens;
+            slot->stop = params.stop;
+            slot->deadline = request_deadline(params, wall_start);
+
+            // tokenize_prompt() works on the instance's images and counters
+            std::swap(counters, slot->counters);
+            images = std::move(req_images[i]);
+            std::string error;
+            try {
+                // Each request samples with its own sampler state and grammar
+                slot->sampler = llama_sampler_clone(sampler);
+                llama_sampler_reset(slot->sampler);
+                const std::string gbnf = request_grammar(params);
+                if (!gbnf.empty()) {
+                    slot->grammar = llama_sampler_init_grammar(vocab, gbnf.c_str(), "root");
+                    if (!slot->grammar)
+                        throw std::runtime_error("pivision: invalid grammar");
+                }
+
+                std::string formatted = format_chat_prompt(tmpl, requests[i].prompt,
+                                                           static_cast<int>(images.size()), marker);
+                slot->prompt = tokenize_prompt(formatted, true, slot->chunks);
+            } catch (const std::exception &e) {
+                error = e.what();
+            }
+            images.clear();
+            std::swap(counters, slot->counters);
+            if (!error.empty()) {
+                out.results[i].error = error;
+                return nullptr;
+            }
+
+            for (const auto &pc : slot->prompt)
+                slot->n_prompt += static_cast<int>(pc.tokens.size());
+            if (slot->prompt.empty() || slot->prompt.back().image) {
+                out.results[i].error = "pivision: prompt must end with text";
+                return nullptr;
+            }
+            return slot;
+        };
+
+        auto finish = [&](BatchSlot &slot) {
+            auto now = chr::steady_clock::now();
+            llama_memory_seq_rm(mem, slot.seq_id, -1, -1);
+            free_seqs.push_back(slot.seq_id);
+            reserved -= slot.reserved;
+
+            RunResult &r = out.results[slot.index];
+            r.content = std::move(slot.content);
+            r.model_desc = model_desc;
+            r.images_processed = static_cast<int>(requests[slot.index].image_paths.size());
+            r.prompt_tokens = slot.counters.prompt_tokens;
+            r.gen_tokens = slot.n_gen;
+            r.total_tokens = r.prompt_tokens + r.gen_tokens;
+            r.ttft_ms = chr::duration<double, std::milli>(slot.first_token - wall_start).count();
+            r.prompt_ms = chr::duration<double, std::milli>(slot.first_token - slot.admitted).count();
+            r.gen_ms = chr::duration<double, std::milli>(now - slot.first_token).count();
+            r.wall_ms = chr::duration<double, std::milli>(now - wall_start).count();
+            r.tokens_per_sec = r.gen_ms > 0.0 ? r.gen_tokens / (r.gen_ms / 1000.0) : 0.0;
+            r.embd_cache_hits = slot.counters.embd_cache_hits;
+            r.embd_cache_misses = slot.counters.embd_cache_misses;
+            r.embd_cache_saved_ms = slot.counters.embd_cache_saved_ms;
+            r.image_decode_ms = slot.counters.image_decode_ms;
+            r.image_resize_ms = slot.counters.image_resize_ms;
+            r.image_peak_bytes = slot.counters.image_peak_bytes;
+            r.image_wait_ms = slot.counters.image_wait_ms;
+            r.tokenize_ms = slot.counters.tokenize_ms;
+            r.encode_ms = slot.counters.encode_ms;
+            r.image_embd_ms = slot.counters.image_embd_ms;
+            r.prefill_ms = slot.counters.prefill_ms;
+            r.detok_ms = slot.counters.detok_ms;
+            r.context_policy = config.context_policy;
+            r.n_threads = llama_n_threads(ctx);
+            r.n_threads_batch = llama_n_threads_batch(ctx);
+            r.n_threads_vision = n_threads_vision;
+            fill_kv_info(r);
+            r.cpu_mask = config.cpu_mask;
+            r.sample_ms = slot.counters.sample_ms;
+            r.sampler = sampler_desc;
+            // The governor acts on the shared context, so every result gets the batch's trace
+            r.thermal_trace = counters.thermal_trace;
+            r.thermal_pause_ms = counters.thermal_pause_ms;
+            r.temp_max_c = std::isnan(counters.temp_max_c) ? 0.0f : counters.temp_max_c;
+            for (const auto &ts : counters.thermal_trace)
+                if (!ts.action.empty()) ++r.thermal_actions;
+            r.stop_reason = slot.stop_reason;
+        };
+
+        std::vector<std::unique_ptr<BatchSlot>> active;
+        std::unique_ptr<BatchSlot> waiting;  // tokenized, waiting for a sequence or cells
+        size_t next = 0;
+
+        while (next < requests.size() || waiting || !active.empty()) {
+            // Admit as many requests as sequences and cells allow
+            for (;;) {
+                if (!waiting) {
+                    if (next == requests.size()) break;
+                    // After a cancel, requests not yet started end without running
+                    if (cancelled()) {
+                        out.results[next].model_desc = model_desc;
+                        out.results[next++].stop_reason = "cancelled";
+                        continue;
+                    }
+                    waiting = prepare(next++);
+                    if (!waiting) continue;
+                }
+                if (free_seqs.empty()) break;
+
+                const int avail = config.n_ctx - reserved;
+                if (waiting->n_prompt + waiting->max_tokens > avail) {
+                    if (!active.empty()) break;  // wait for running requests to release cells
+                    // Alone and still too long: shorten the reply budget
+                    waiting->max_tokens = avail - waiting->n_prompt;
+                    waiting->clipped = true;
+                    if (waiting->max_tokens <= 0) {
+                        out.results[waiting->index].error = "pivision: prompt does not fit in the context";
+                        waiting.reset();
+                        continue;
+                    }
+                }
+
+                waiting->seq_id = free_seqs.back();
+                free_seqs.pop_back();
+                waiting->reserved = waiting->n_prompt + waiting->max_tokens;
+                waiting->admitted = chr::steady_clock::now();
+                reserved += waiting->reserved;
+                out.peak_parallel = std::max(out.peak_parallel, static_cast<int>(active.size()) + 1);
+                active.push_back(std::move(waiting));
+            }
+            if (active.empty()) continue;
+
+            // Image chunks go through the mtmd helper on their own
+            for (auto &slot : active) {
+                while (slot->chunk < slot->prompt.size() && slot->prompt[slot->chunk].image) {
+                    std::swap(counters, slot->counters);
+                    int32_t res = eval_image_chunk(slot->prompt[slot->chunk].image, slot->seq_id, slot->pos);
+                    std::swap(counters, slot->counters);
+                    if (res != 0) {
+                        out.results[slot->index].error = "pivision: failed to eval image chunk (code " + std::to_string(res) + ")";
+                        slot->failed = true;
+                        break;
+                    }
+                    ++slot->chunk;
+                }
+            }
+
+            common_batch_clear(batch);
+            // One token for every generating request...
+            for (auto &slot : active) {
+                slot->n_prefill = 0;
+                if (slot->failed || slot->pending == LLAMA_TOKEN_NULL) continue;
+                slot->i_batch = batch.n_tokens;
+                common_batch_add(batch, slot->pending, slot->pos++, {slot->seq_id}, true);
+            }
+            // ...and the remaining room for prompt text, up to the next image of each request
+            for (auto &slot : active) {
+                while (!slot->failed && batch.n_tokens < n_batch &&
+                       slot->chunk < slot->prompt.size() && !slot->prompt[slot->chunk].image) {
+                    const auto &tokens = slot->prompt[slot->chunk].tokens;
+                    const bool last_chunk = slot->chunk + 1 == slot->prompt.size();
+                    const size_t n_take = std::min(tokens.size() - slot->offset, static_cast<size_t>(n_batch - batch.n_tokens));
+                    for (size_t j = 0; j < n_take; ++j) {
+                        const bool last = last_chunk && slot->offset + j + 1 == tokens.size();
+                        if (last) slot->i_batch = batch.n_tokens;
+                        common_batch_add(batch, tokens[slot->offset + j], slot->pos++, {slot->seq_id}, last);
+                    }
+                    slot->counters.prompt_tokens += static_cast<int>(n_take);
+                    slot->n_prefill += static_cast<int>(n_take);
+                    slot->offset += n_take;
+                    if (slot->offset == tokens.size()) {
+                        ++slot->chunk;
+                        slot->offset = 0;
+                    }
+                    // An image must see the text before it, so it waits for this batch
+                    if (slot->chunk < slot->prompt.size() && slot->prompt[slot->chunk].image) break;
+                }
+            }
+
+            if (batch.n_tokens > 0) {
+                auto t0 = chr::steady_clock::now();
+                const bool ok = llama_decode(ctx, batch) == 0;
+                const double ms = chr::duration<double, std::milli>(chr::steady_clock::now() - t0).count();
+                for (auto &slot : active) {
+                    if (!ok) {
+                        out.results[slot->index].error = "pivision: batched decode failed";
+                        slot->failed = true;
+                    }
+                    // Prefill is charged by each request's share of the batch's tokens
+                    slot->counters.prefill_ms += ms * slot->n_prefill / batch.n_tokens;
+                }
+            }
+
+            for (auto &slot : active) {
+                if (slot->failed || slot->i_batch < 0) continue;
+                // sample_token() with the request's sampler, grammar and counters
+                std::swap(sampler, slot->sampler);
+                std::swap(grammar, slot->grammar);
+                std::swap(counters, slot->counters);
+                llama_token t = sample_token(slot->i_batch);
+                std::swap(sampler, slot->sampler);
+                std::swap(grammar, slot->grammar);
+                std::swap(counters, slot->counters);
+                slot->i_batch = -1;
+                if (slot->pending == LLAMA_TOKEN_NULL)
+                    slot->first_token = chr::steady_clock::now();
+                else
+                    ++slot->n_gen;
+
+                if (llama_vocab_is_eog(vocab, t) || slot->n_gen >= slot->max_tokens) {
+                    slot->stop_reason = llama_vocab_is_eog(vocab, t) ? "eos" : slot->clipped ? "context" : "max_tokens";
+                    slot->done = true;
+                    continue;
+                }
+                if (cancelled() || chr::steady_clock::now() >= slot->deadline) {
+                    slot->stop_reason = cancelled() ? "cancelled" : "deadline";
+                    slot->done = true;
+                    continue;
+                }
+                char buf[256];
+                auto t_detok = chr::steady_clock::now();
+                int n = llama_token_to_piece(vocab, t, buf, sizeof(buf), 0, true);
+                slot->counters.detok_ms += chr::duration<double, std::milli>(chr::steady_clock::now() - t_detok).count();
+                if (n > 0) {
+                    slot->content.append(buf, static_cast<size_t>(n));
+                    const size_t pos = find_stop(slot->content, static_cast<size_t>(n), slot->stop);
+                    if (pos != std::string::npos) {
+                        slot->content.resize(pos);
+                        slot->stop_reason = "stop";
+                        slot->done = true;
+                        continue;
+                    }
+                }
+                slot->pending = t;
+            }
+            // One governor step per batched decode
+            thermal_tick();
+
+            for (size_t i = 0; i < active.size();) {
+                BatchSlot &slot = *active[i];
+                if (slot.done || slot.failed) {
+                    if (slot.done) finish(slot);
+                    else {
+                        llama_memory_seq_rm(mem, slot.seq_id, -1, -1);
+                        free_seqs.push_back(slot.seq_id);
+                        reserved -= slot.reserved;
+                    }
+                    out.gen_tokens += slot.n_gen;
+                    out.prompt_tokens += slot.counters.prompt_tokens;
+                    active.erase(active.begin() + i);
+                } else {
+                    ++i;
+                }
+            }
+        }
+
+        images = std::move(user_images);
+
+        out.wall_ms = chr::duration<double, std::milli>(chr::steady_clock::now() - wall_start).count();
+        out.tokens_per_sec = out.wall_ms > 0.0 ? out.gen_tokens / (out.wall_ms / 1000.0) : 0.0;
+        out.load_ms = load_reported ? 0.0 : load_ms;
+        load_reported = true;
+        return out;
+    }
+
+    const cpu_set_t *affinity() const {
+        return has_cpu_mask ? &cpu_mask : nullptr;
     }
 
     void chat_clear_inner() {
-        llama_memory_clear(llama_get_memory(ctx), true);
+        // Pinned prefixes live in other sequences and survive
+        llama_memory_seq_rm(llama_get_memory(ctx), 0, -1, -1);
+        kv_tokens.clear();
+        turns.clear();
         n_past = 0;
         chat_history.clear();
     }
+
+    // Session file: SessionHeader, model description, chat history, the token
+    // at every seq 0 position, the turn spans, then the raw llama seq 0 state
+    struct SessionHeader {
+        char     magic[8];
+        uint64_t model_size;
+        int64_t  n_past;
+        uint64_t n_history;
+        uint64_t n_kv_tokens;
+        uint64_t n_turns;
+        uint64_t state_size;
+    };
+    static constexpr char SESSION_MAGIC[8] = {'P', 'V', 'S', 'E', 'S', 'S', '2', '\0'};
+
+    static void put_string(std::ofstream &f, const std::string &s) {
+        uint32_t n = static_cast<uint32_t>(s.size());
+        f.write(reinterpret_cast<const char *>(&n), sizeof(n));
+        f.write(s.data(), n);
+    }
+
+    static bool get_string(const char *&p, const char *end, std::string &s) {
+        uint32_t n;
+        if (end - p < static_cast<ptrdiff_t>(sizeof(n))) return false;
+        std::memcpy(&n, p, sizeof(n));
+        p += sizeof(n);
+        if (static_cast<size_t>(end - p) < n) return false;
+        s.assign(p, n);
+        p += n;
+        return true;
+    }
+
+    SessionIO save_session_inner(const std::string &path) {
+        namespace chr = std::chrono;
+        auto t0 = chr::steady_clock::now();
+        SessionIO io;
+
+        std::vector<uint8_t> state(llama_state_seq_get_size(ctx, 0));
+        if (llama_state_seq_get_data(ctx, state.data(), state.size(), 0) != state.size()) {
+            io.error = "failed to read KV state";
+            return io;
+        }
+
+        SessionHeader hdr;
+        std::memcpy(hdr.magic, SESSION_MAGIC, sizeof(SESSION_MAGIC));
+        hdr.model_size = llama_model_size(model);
+        hdr.n_past = n_past;
+        hdr.n_history = chat_history.size();
+        hdr.n_kv_tokens = kv_tokens.size();
+        hdr.n_turns = turns.size();
+        hdr.state_size = state.size();
+
+        const std::string tmp = path + ".tmp";
+        std::ofstream f(tmp, std::ios::binary);
+        f.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+        put_string(f, model_desc);
+        for (const auto &msg : chat_history) {
+            put_string(f, msg.role);
+            put_string(f, msg.content);
+        }
+        f.write(reinterpret_cast<const char *>(kv_tokens.data()),
+                static_cast<std::streamsize>(kv_tokens.size() * sizeof(llama_token)));
+        f.write(reinterpret_cast<const char *>(turns.data()),
+                static_cast<std::streamsize>(turns.size() * sizeof(TurnSpan)));
+        f.write(reinterpret_cast<const char *>(state.data()), static_cast<std::streamsize>(state.size()));
+        io.bytes = static_cast<size_t>(f.tellp());
+        f.close();
+
+        if (!f || std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            io.error = "cannot write " + path;
+            return io;
+        }
+
+        io.ok = true;
+        io.n_tokens = static_cast<int>(n_past);
+        io.ms = chr::duration<double, std::milli>(chr::steady_clock::now() - t0).count();
+        return io;
+    }
+
+    SessionIO load_session_inner(const std::string &path) {
+        namespace chr = std::chrono;
+        auto t0 = chr::steady_clock::now();
+        SessionIO io;
+
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            io.error = "cannot open " + path;
+            return io;
+        }
+        struct stat st {};
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SessionHeader)) {
+            close(fd);
+            io.error = "not a session file: " + path;
+            return io;
+        }
+        const size_t len = static_cast<size_t>(st.st_size);
+        void *map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            io.error = "cannot map " + path;
+            return io;
+        }
+        madvise(map, len, MADV_SEQUENTIAL);
+
+        const char *p = static_cast<const char *>(map);
+        const char *end = p + len;
+
+        SessionHeader hdr;
+        std::memcpy(&hdr, p, sizeof(hdr));
+        p += sizeof(hdr);
+
+        std::string desc;
+        std::vector<common_chat_msg> history;
+        std::vector<llama_token> tokens;
+        std::vector<TurnSpan> spans;
+        bool valid = std::memcmp(hdr.magic, SESSION_MAGIC, sizeof(SESSION_MAGIC)) == 0 && get_string(p, end, desc);
+
+        if (valid && (desc != model_desc || hdr.model_size != llama_model_size(model))) {
+            io.error = "session was saved with a different model (" + desc + ")";
+        } else if (valid) {
+            for (uint64_t i = 0; valid && i < hdr.n_history; ++i) {
+                common_chat_msg msg;
+                valid = get_string(p, end, msg.role) && get_string(p, end, msg.content);
+                history.push_back(std::move(msg));
+            }
+            const size_t tok_bytes = hdr.n_kv_tokens * sizeof(llama_token);
+            const size_t turn_bytes = hdr.n_turns * sizeof(TurnSpan);
+            valid = valid && static_cast<size_t>(end - p) >= tok_bytes + turn_bytes &&
+                    static_cast<size_t>(end - p) - tok_bytes - turn_bytes == hdr.state_size;
+            if (valid) {
+                tokens.resize(hdr.n_kv_tokens);
+                std::memcpy(tokens.data(), p, tok_bytes);
+                p += tok_bytes;
+                // Image pseudo tokens are per instance: the restored images never match a new one
+                for (llama_token &t : tokens)
+                    if (t < LLAMA_TOKEN_NULL) t = LLAMA_TOKEN_NULL;
+                spans.resize(hdr.n_turns);
+                std::memcpy(spans.data(), p, turn_bytes);
+                p += turn_bytes;
+            }
+        }
+        if (!valid && io.error.empty())
+            io.error = "corrupt session file: " + path;
+
+        if (io.error.empty()) {
+            llama_memory_seq_rm(llama_get_memory(ctx), 0, -1, -1);
+            if (llama_state_seq_set_data(ctx, reinterpret_cast<const uint8_t *>(p), hdr.state_size, 0) == 0) {
+                io.error = "failed to restore KV state from " + path;
+                llama_memory_seq_rm(llama_get_memory(ctx), 0, -1, -1);
+                history.clear();
+                tokens.clear();
+                spans.clear();
+                hdr.n_past = 0;
+            }
+            // Either the restored session or, on failure, an empty conversation
+            chat_history = std::move(history);
+            kv_tokens = std::move(tokens);
+            turns = std::move(spans);
+            n_past = static_cast<llama_pos>(hdr.n_past);
+            images.clear();
+        }
+        munmap(map, len);
+
+        io.ok = io.error.empty();
+        io.bytes = len;
+        io.n_tokens = io.ok ? static_cast<int>(n_past) : 0;
+        io.ms = chr::duration<double, std::milli>(chr::steady_clock::now() - t0).count();
+        return io;
+    }
 };
 
 // ---------------------------------------------------------------------------
@@ -380,29 +2796,310 @@ bool PiVision::load_image(const std::string &path) {
     return impl_->load_image(path);
 }
 
-void PiVision::run(const std::string &prompt, std::function<void(const std::string &)> stream_cb) {
-    RunResult unused;
-    impl_->run_inner(prompt, std::move(stream_cb), unused);
+bool PiVision::load_image_buffer(const uint8_t *data, size_t size) {
+    return impl_->load_image_buffer(data, size);
+}
+
+bool PiVision::load_image_rgb(const uint8_t *rgb, int width, int height, int stride) {
+    return impl_->load_image_rgb(rgb, width, height, stride);
+}
+
+void PiVision::load_image_async(const std::string &path) {
+    impl_->load_image_async(path);
+}
+
+void PiVision::clear_images() {
+    impl_->clear_images();
 }
 
-RunResult PiVision::run_collect(const std::string &prompt) {
+const LoadTimings &PiVision::load_timings() const {
+    return impl_->load_timings;
+}
+
+const MemoryPlan &PiVision::memory_plan() const {
+    return impl_->plan;
+}
+
+MemoryPlan PiVision::plan_memory(const PiVisionConfig &config) {
+    return plan_memory_impl(config);
+}
+
+RunResult PiVision::run(const std::string &prompt, std::function<void(const std::string &)> stream_cb,
+                        const GenerationParams &gen) {
+    AffinityScope pin(impl_->affinity());
+    RunResult result;
+    impl_->request_id = impl_->issue_request();
+    impl_->run_inner(prompt, [&](const TokenEvent &ev) { if (stream_cb) stream_cb(ev.piece); }, gen, result);
+    return result;
+}
+
+RunResult PiVision::run_events(const std::string &prompt, TokenCallback event_cb, const GenerationParams &gen) {
+    AffinityScope pin(impl_->affinity());
+    RunResult result;
+    impl_->request_id = impl_->issue_request();
+    impl_->run_inner(prompt, event_cb, gen, result);
+    return result;
+}
+
+// Members go in reverse: `result` first, whose destructor waits for the run
+// that still reads `cancel`
+struct RunHandle::State {
+    std::atomic<bool> cancel{false};
+    std::future<RunResult> result;
+};
+
+void RunHandle::cancel() {
+    if (state_) state_->cancel = true;
+}
+
+bool RunHandle::ready() const {
+    return wait_for(0);
+}
+
+bool RunHandle::wait_for(int timeout_ms) const {
+    return state_ && state_->result.valid()
+        && state_->result.wait_for(std::chrono::milliseconds(timeout_ms)) == std::future_status::ready;
+}
+
+RunResult RunHandle::get() {
+    if (!state_ || !state_->result.valid())
+        throw std::runtime_error("pivision: run handle has no result");
+    return state_->result.get();
+}
+
+RunHandle PiVision::run_async(const std::string &prompt, TokenCallback event_cb, const GenerationParams &gen) {
+    RunHandle handle;
+    handle.state_ = std::make_shared<RunHandle::State>();
+    const std::atomic<bool> *cancel = &handle.state_->cancel;
+    Impl *impl = impl_.get();
+    // Issued now, so PiVision::cancel() reaches the request before its thread starts
+    const uint32_t id = impl->issue_request();
+    handle.state_->result = std::async(std::launch::async, [impl, id, cancel, prompt, event_cb, gen]() {
+        AffinityScope pin(impl->affinity());
+        RunResult result;
+        impl->request_id = id;
+        impl->handle_cancel = cancel;
+        try {
+            impl->run_inner(prompt, event_cb, gen, result);
+        } catch (...) {
+            impl->handle_cancel = nullptr;
+            throw;
+        }
+        impl->handle_cancel = nullptr;
+        return result;
+    });
+    return handle;
+}
+
+void PiVision::cancel() {
+    impl_->cancelled_request = impl_->active_request.load();
+}
+
+RunResult PiVision::run_collect(const std::string &prompt, const GenerationParams &gen) {
+    AffinityScope pin(impl_->affinity());
     RunResult result;
-    impl_->run_inner(prompt, nullptr, result);
+    impl_->request_id = impl_->issue_request();
+    impl_->run_inner(prompt, nullptr, gen, result);
     return result;
 }
 
-RunResult PiVision::chat_turn(const std::string &user_message, std::function<void(const std::string &)> stream_cb) {
+RunResult PiVision::chat_turn(const std::string &user_message, std::function<void(const std::string &)> stream_cb,
+                              const GenerationParams &gen) {
+    AffinityScope pin(impl_->affinity());
     RunResult result;
-    impl_->chat_turn_inner(user_message, std::move(stream_cb), result);
+    impl_->request_id = impl_->issue_request();
+    impl_->chat_turn_inner(user_message, [&](const TokenEvent &ev) { if (stream_cb) stream_cb(ev.piece); }, gen, result);
     return result;
 }
 
-RunResult PiVision::chat_turn_collect(const std::string &user_message) {
+RunResult PiVision::chat_turn_events(const std::string &user_message, TokenCallback event_cb,
+                                     const GenerationParams &gen) {
+    AffinityScope pin(impl_->affinity());
     RunResult result;
-    impl_->chat_turn_inner(user_message, nullptr, result);
+    impl_->request_id = impl_->issue_request();
+    impl_->chat_turn_inner(user_message, event_cb, gen, result);
     return result;
 }
 
+RunResult PiVision::chat_turn_collect(const std::string &user_message, const GenerationParams &gen) {
+    AffinityScope pin(impl_->affinity());
+    RunResult result;
+    impl_->request_id = impl_->issue_request();
+    impl_->chat_turn_inner(user_message, nullptr, gen, result);
+    return result;
+}
+
+bool PiVision::pin_prefix(const std::string &name, const std::string &prefix) {
+    AffinityScope pin(impl_->affinity());
+    return impl_->pin_prefix_inner(name, prefix);
+}
+
+void PiVision::unpin_prefix(const std::string &name) {
+    impl_->unpin_prefix_inner(name);
+}
+
+BatchResult PiVision::run_batch(const std::vector<BatchRequest> &requests) {
+    AffinityScope pin(impl_->affinity());
+    impl_->request_id = impl_->issue_request();
+    return impl_->run_batch_inner(requests);
+}
+
 void PiVision::chat_clear() {
     impl_->chat_clear_inner();
 }
+
+SessionIO PiVision::save_session(const std::string &path) {
+    return impl_->save_session_inner(path);
+}
+
+SessionIO PiVision::load_session(const std::string &path) {
+    return impl_->load_session_inner(path);
+}
+
+// ---------------------------------------------------------------------------
+
+struct PoolEntry {
+    std::string name;
+    PiVisionConfig config;
+    std::unique_ptr<PiVision> pv;
+    size_t bytes = 0;        // planned memory while resident
+    uint64_t last_used = 0;  // PiVisionPool::Impl::clock at the latest get()
+};
+
+struct PiVisionPool::Impl {
+    size_t memory_cap = 0;
+    size_t base_available = 0;  // MemAvailable before the pool loaded anything; 0 if unknown
+    PoolEventCallback on_event;
+    std::vector<PoolEntry> entries;
+    size_t resident_bytes = 0;
+    uint64_t clock = 0;
+
+    PoolEntry *find(const std::string &name) {
+        for (auto &e : entries)
+            if (e.name == name) return &e;
+        return nullptr;
+    }
+
+    void report(const char *type, const PoolEntry &e, double ms) {
+        if (!on_event) return;
+        PoolEvent ev;
+        ev.type = type;
+        ev.name = e.name;
+        ev.ms = ms;
+        ev.bytes = e.bytes;
+        ev.resident_bytes = resident_bytes;
+        on_event(ev);
+    }
+
+    void unload(PoolEntry &e) {
+        if (!e.pv) return;
+        auto t0 = std::chrono::steady_clock::now();
+        e.pv.reset();
+        resident_bytes -= e.bytes;
+        report("evict", e, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+    }
+
+    PoolEntry *least_recently_used() {
+        PoolEntry *lru = nullptr;
+        for (auto &e : entries)
+            if (e.pv && (!lru || e.last_used < lru->last_used)) lru = &e;
+        return lru;
+    }
+
+    PiVision &get(const std::string &name) {
+        namespace chr = std::chrono;
+        auto t0 = chr::steady_clock::now();
+        PoolEntry *e = find(name);
+        if (!e)
+            throw std::runtime_error("pivision: unknown model: " + name);
+        e->last_used = ++clock;
+        if (e->pv) {
+            report("hit", *e, chr::duration<double, std::milli>(chr::steady_clock::now() - t0).count());
+            return *e->pv;
+        }
+
+        MemoryPlan plan = plan_memory_impl(e->config);
+        if (!plan.error.empty())
+            throw std::runtime_error("pivision: " + plan.error);
+        const size_t need = plan.total_bytes - plan.margin_bytes;
+
+        // The budget is checked against the pool's own plans of what it
+        // holds, not a fresh MemAvailable: mmap'd weights count as available
+        // page cache whether or not their model is loaded
+        size_t budget = memory_cap;
+        if (e->config.check_memory && base_available > plan.margin_bytes) {
+            const size_t avail = base_available - plan.margin_bytes;
+            budget = budget > 0 ? std::min(budget, avail) : avail;
+        }
+        if (budget > 0 && need > budget)
+            throw std::runtime_error("pivision: model " + name + " needs " + format_gb(need) +
+                                     ", more than the pool's budget of " + format_gb(budget));
+
+        while (budget > 0 && resident_bytes + need > budget) {
+            PoolEntry *victim = least_recently_used();
+            if (!victim) break;
+            unload(*victim);
+        }
+
+        // Checked above; the instance's own check would see MemAvailable
+        // without the models still resident
+        PiVisionConfig cfg = e->config;
+        cfg.check_memory = false;
+        auto t1 = chr::steady_clock::now();
+        e->pv = std::make_unique<PiVision>(cfg);
+        e->bytes = need;
+        resident_bytes += need;
+        report("load", *e, chr::duration<double, std::milli>(chr::steady_clock::now() - t1).count());
+        return *e->pv;
+    }
+};
+
+PiVisionPool::PiVisionPool(size_t memory_cap, PoolEventCallback on_event)
+    : impl_(std::make_unique<Impl>()) {
+    impl_->memory_cap = memory_cap;
+    impl_->base_available = mem_available_bytes();
+    impl_->on_event = std::move(on_event);
+}
+
+PiVisionPool::~PiVisionPool() = default;
+
+void PiVisionPool::add(const std::string &name, const PiVisionConfig &config) {
+    if (PoolEntry *e = impl_->find(name)) {
+        impl_->unload(*e);
+        e->config = config;
+        return;
+    }
+    PoolEntry e;
+    e.name = name;
+    e.config = config;
+    impl_->entries.push_back(std::move(e));
+}
+
+bool PiVisionPool::has(const std::string &name) const {
+    return impl_->find(name) != nullptr;
+}
+
+std::vector<std::string> PiVisionPool::names() const {
+    std::vector<std::string> out;
+    for (const auto &e : impl_->entries)
+        out.push_back(e.name);
+    return out;
+}
+
+PiVision &PiVisionPool::get(const std::string &name) {
+    return impl_->get(name);
+}
+
+bool PiVisionPool::resident(const std::string &name) const {
+    const PoolEntry *e = impl_->find(name);
+    return e && e->pv;
+}
+
+void PiVisionPool::evict(const std::string &name) {
+    if (PoolEntry *e = impl_->find(name))
+        impl_->unload(*e);
+}
+
+size_t PiVisionPool::resident_bytes() const {
+    return impl_->resident_bytes;
+}
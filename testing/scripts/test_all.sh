@@ -13,21 +13,17 @@ for model in "${MODELS[@]}"; do
         if [ -d "$dir" ]; then
                 echo "== running: $model =="
 		
-                for config in "$dir"/*.json; do
+                # one process per model: the GGUF and mmproj are loaded once for every config
+                "$PROGRAM" --batch "$dir"
 
-												echo "running config: $config"
-												"$PROGRAM" --config "$config"
-
-														EXIT_STATUS=$?
-														if [ $EXIT_STATUS -ne 0 ]; then
-																	ERROR_FILE="$ERROR_DIR/pivision_error_$(date +%Y-%m-%d_%H-%M-%S).txt"
-																	echo "Pivision failed with exit status $EXIT_STATUS" >> "$ERROR_FILE"
-																	echo "Model: $model" >> "$ERROR_FILE"
-																	echo "Config file: $config" >> "$ERROR_FILE"
-																	echo "Test: $test" >> "$ERROR_FILE"
-																	exit 1
-														fi
-                done
+                EXIT_STATUS=$?
+                if [ $EXIT_STATUS -ne 0 ]; then
+                        ERROR_FILE="$ERROR_DIR/pivision_error_$(date +%Y-%m-%d_%H-%M-%S).txt"
+                        echo "Pivision batch failed with exit status $EXIT_STATUS" >> "$ERROR_FILE"
+                        echo "Model: $model" >> "$ERROR_FILE"
+                        echo "Config directory: $dir" >> "$ERROR_FILE"
+                        exit 1
+                fi
         else 
                 echo "$model not found"
         fi